@@ -1,31 +1,40 @@
-import sys
+import argparse
+import json
 
 
 def main():
-    if len(sys.argv) not in (2, 3):
-        print(
-            f'usage: {sys.argv[0]} SOURCE-FILE [OUT-FILE]',
-            file=sys.stderr,
-        )
-        return -1
+    parser = argparse.ArgumentParser(prog='python -m compiler')
+    parser.add_argument('source', metavar='SOURCE-FILE')
+    parser.add_argument('out', metavar='OUT-FILE', nargs='?', default='a.um')
+    parser.add_argument(
+        '--single-array',
+        action='store_true',
+        help='link every function into array 0',
+    )
+    parser.add_argument(
+        '--map',
+        metavar='PATH',
+        help='write a map of the code back to the source to PATH as JSON, for'
+        ' etc/profile-report',
+    )
+    args = parser.parse_args()
 
     from compiler.ast import parse
-    from compiler.compiler import compile_ast
+    from compiler.compiler import compile_program
 
-    try:
-        out_path = sys.argv[2]
-    except IndexError:
-        out_path = 'a.um'
-
-    with open(sys.argv[1]) as source_file:
+    with open(args.source) as source_file:
         source = source_file.read()
 
-    tree = parse(source, filename=sys.argv[1])
-    bytecode = compile_ast(tree)
+    tree = parse(source, filename=args.source)
+    bytecode, code_map = compile_program(tree, single_array=args.single_array)
 
-    with open(out_path, 'wb') as out_file:
+    with open(args.out, 'wb') as out_file:
         out_file.write(bytecode)
 
+    if args.map is not None:
+        with open(args.map, 'w') as map_file:
+            json.dump({'source': args.source, 'arrays': code_map}, map_file)
+
     return 0
 
 
@@ -137,6 +137,13 @@ class If(Node):
     __slots__ = 'test', 'true', 'false'
 
 
+class Line(Node):
+    """The start of the statement on line ``lineno``, for the compiler's map of
+    code back to the source.
+    """
+    __slots__ = 'lineno',
+
+
 class _AstTranslator(ast.NodeVisitor):
     def __init__(self, globals, functions, body, filename, lines):
         self.globals = globals
@@ -308,7 +315,7 @@ class _TopLevelTranslator(_AstTranslator):
             self.lines,
         )
         for n in node.body:
-            t.visit(n)
+            t.visit_statement(n)
 
         argnames = {arg.name for arg in args}
         self.body.append(
@@ -332,6 +339,10 @@ class _FunctionTranslator(_AstTranslator):
         self.namespace = {arg.name: arg for arg in arguments}
         self._return_type = return_type
 
+    def visit_statement(self, node):
+        self.body.append(Line(node.lineno))
+        self.visit(node)
+
     def visit_FunctionDef(self, node):
         self.syntax_error(node, 'UML does not support closures')
 
@@ -495,7 +506,7 @@ class _FunctionTranslator(_AstTranslator):
 
         with self.scoped_body() as body:
             for n in node.body:
-                self.visit(n)
+                self.visit_statement(n)
 
         self.body.append(For(
             target,
@@ -520,11 +531,11 @@ class _FunctionTranslator(_AstTranslator):
 
         with self.scoped_body() as true:
             for n in node.body:
-                self.visit(n)
+                self.visit_statement(n)
 
         with self.scoped_body() as false:
             for n in node.orelse:
-                self.visit(n)
+                self.visit_statement(n)
 
         self.body.append(If(
             test,
@@ -6,10 +6,20 @@ import sys
 from . import ast
 from . import instructions as instrs
 from .immutable import immutable
+from .optimize import assemble, optimize
 from .runtime_constants import Register, STACK_SIZE
 
 
-def _static_allocations_without_literal_arrays(nodes):
+def _static_allocations_without_literal_arrays(nodes, single_array):
+    if single_array:
+        # functions are code in array 0, only global arrays are allocated
+        arrays = (
+            node for node in nodes
+            if isinstance(node, ast.Global) and node.type == 'array'
+        )
+        yield from ((node, n) for n, node in enumerate(arrays))
+        return
+
     for n, node in enumerate(nodes):
         if ((isinstance(node, ast.Global) and node.type == 'array') or
                 isinstance(node, ast.FunctionDef)):
@@ -67,6 +77,9 @@ class Context(immutable):
         'registers',
         'locals',
         'current_array_address',
+        'function_labels',
+        'function',
+        'source_lines',
     )
 
     def __init__(self,
@@ -74,15 +87,33 @@ class Context(immutable):
                  function_bodies,
                  registers=None,
                  locals=None,
-                 current_array_address=None):
+                 current_array_address=None,
+                 function_labels=None,
+                 function=None,
+                 source_lines=None):
         if registers is None:
             registers = RegisterAllocator()
+        if source_lines is None:
+            source_lines = {}
 
         self.static_allocations = static_allocations
         self.function_bodies = function_bodies
         self.registers = registers
         self.locals = locals
         self.current_array_address = current_array_address
+        # the label of each function in single array mode, else None
+        self.function_labels = function_labels
+        # the name of the function being compiled
+        self.function = function
+        # the ``(position, function, line)``s of each of ``function_bodies``
+        self.source_lines = source_lines
+
+    @property
+    def single_array(self):
+        """Whether every function is linked into array 0, so that calls and
+        branches are jumps instead of loads of another array.
+        """
+        return self.function_labels is not None
 
     def static_address(self, node):
         return self.static_allocations.setdefault(
@@ -99,6 +130,13 @@ class Context(immutable):
     def pop(self, register):
         return instrs.Pop(register, self.registers)
 
+    def jump(self, target):
+        """Jump to the finger in ``target`` within array 0.
+        """
+        with self.registers.occupy() as zero:
+            yield self.immediate(zero, 0)
+            yield instrs.LoadProgram(zero, target)
+
 
 @singledispatch
 def compile_node(node, ctx):
@@ -112,9 +150,11 @@ def _compile_function_def(node, ctx):
     locals_ = {l: n for n, l in enumerate(chain(node.args, node.locals))}
     ctx = ctx.update(
         locals=locals_,
-        current_array_address=ctx.static_allocations[node],
+        current_array_address=ctx.static_allocations.get(node),
+        function=node.name,
     )
 
+    yield instrs.SourceLine(node.name)
     with ctx.registers.occupy() as imm:
         yield ctx.immediate(imm, len(node.locals) + len(node.args))
         yield instrs.Allocation(Register.locals, imm)
@@ -140,6 +180,14 @@ def _compile_function_def(node, ctx):
 
     if node.name == 'main':
         yield instrs.Halt()
+    elif ctx.single_array:
+        with ctx.registers.occupy() as return_address:
+            yield ctx.pop(return_address)
+
+            # restore locals
+            yield ctx.pop(Register.locals)
+
+            yield from ctx.jump(return_address)
     else:
         with ctx.registers.occupy() as return_array, \
                 ctx.registers.occupy() as return_address:
@@ -154,16 +202,54 @@ def _compile_function_def(node, ctx):
 
 @compile_node.register(ast.If)
 def _compile_if(node, ctx):
+    if ctx.single_array:
+        return _compile_if_single_array(node, ctx)
+
+    return _compile_if_array_per_branch(node, ctx)
+
+
+def _compile_if_single_array(node, ctx):
+    true_label = instrs.Label()
+    false_label = instrs.Label()
+    end_label = instrs.Label()
+
+    with ctx.registers.occupy() as false:
+        with (yield from compute_into_register(node.test, ctx)) as test, \
+                ctx.registers.occupy() as true:
+            yield instrs.Orthography(true, true_label)
+            yield instrs.Orthography(false, false_label)
+            yield instrs.ConditionalMove(false, true, test)
+
+        yield from ctx.jump(false)
+
+    yield true_label
+    for subnode in node.true.body:
+        yield from compile_node(subnode, ctx)
+
+    with ctx.registers.occupy() as end:
+        yield instrs.Orthography(end, end_label)
+        yield from ctx.jump(end)
+
+    yield false_label
+    for subnode in node.false.body:
+        yield from compile_node(subnode, ctx)
+
+    yield end_label
+
+
+def _compile_if_array_per_branch(node, ctx):
     # recursively compile the branches
     true_ctx = ctx.update(current_array_address=ctx.static_address(node.true))
-    ctx.function_bodies[node.true] = list(
-        _ll_instrs(compile_node(node.true, true_ctx)),
+    ctx.function_bodies[node.true] = _ll_instrs(
+        compile_node(node.true, true_ctx),
+        ctx.source_lines.setdefault(node.true, []),
     )
     false_ctx = ctx.update(
         current_array_address=ctx.static_address(node.false),
     )
-    ctx.function_bodies[node.false] = list(
-        _ll_instrs(compile_node(node.false, false_ctx)),
+    ctx.function_bodies[node.false] = _ll_instrs(
+        compile_node(node.false, false_ctx),
+        ctx.source_lines.setdefault(node.false, []),
     )
 
     with ctx.registers.occupy() as current_address:
@@ -184,21 +270,23 @@ def _compile_if(node, ctx):
             yield ctx.immediate(false, ctx.static_address(node.false))
             yield instrs.ArrayIndex(false, Register.pic_table, false)
 
-            ret_address = yield instrs.ConditionalMove(false, true, test)
+            yield instrs.ConditionalMove(false, true, test)
             selected_branch_address = false
 
+        resume = instrs.Label()
         with ctx.registers.occupy() as imm:
-            # use an orthography instead of immediate to ensure a fixed size
-            # between the address and the place to resume
-            yield instrs.Orthography(imm, ret_address + 6)
+            yield instrs.Orthography(imm, resume)
             yield ctx.push(imm)
 
-            yield instrs.Orthography(imm, 0)
+            yield ctx.immediate(imm, 0)
             yield instrs.LoadProgram(selected_branch_address, imm)
 
+        yield resume
+
 
 @compile_node.register(ast.IfBranch)
 def _compile_if_branch(node, ctx):
+    yield instrs.SourceLine(ctx.function)
     for subnode in node.body:
         yield from compile_node(subnode, ctx)
 
@@ -210,6 +298,11 @@ def _compile_if_branch(node, ctx):
         yield instrs.LoadProgram(return_array, return_address)
 
 
+@compile_node.register(ast.Line)
+def _compile_line(node, ctx):
+    yield instrs.SourceLine(ctx.function, node.lineno)
+
+
 @compile_node.register(ast.Call)
 def _compile_call(node, ctx):
     return _call(False, node, ctx)
@@ -223,41 +316,34 @@ def _call(expr, node, ctx):
     # save the current locals
     yield ctx.push(Register.locals)
 
-    with ctx.registers.occupy() as current_address:
-        yield ctx.immediate(current_address, ctx.current_array_address)
-        yield instrs.ArrayIndex(
-            current_address,
-            Register.pic_table,
-            current_address,
-        )
-        yield ctx.push(current_address)
+    if not ctx.single_array:
+        with ctx.registers.occupy() as current_address:
+            yield ctx.immediate(current_address, ctx.current_array_address)
+            yield instrs.ArrayIndex(
+                current_address,
+                Register.pic_table,
+                current_address,
+            )
+            yield ctx.push(current_address)
 
     # compute args rtl so that TOS is args[0] when we are done
     for arg in reversed(node.args):
         with (yield from compute_into_register(arg, ctx)) as r:
             yield ctx.push(r)
 
-    with ctx.registers.occupy() as call_addr:
-        function_address = ctx.static_allocations[ast.FunctionDef(
-            node.function,
-            (),
-            (),
-            (),
-            node.type,
-        )]
-        yield ctx.immediate(call_addr, function_address)
-        ret_address = (
-            yield instrs.ArrayIndex(call_addr, Register.pic_table, call_addr)
-        )
+    function = ast.FunctionDef(node.function, (), (), (), node.type)
+    if ctx.single_array:
+        resume = instrs.Label()
+        with ctx.registers.occupy() as target:
+            yield instrs.Orthography(target, resume)
+            yield ctx.push(target)
 
-        with ctx.registers.occupy() as imm:
-            # use an orthography instead of immediate to ensure a fixed size
-            # between the address and the place to resume
-            yield instrs.Orthography(imm, ret_address + 6)
-            yield ctx.push(imm)
+            yield instrs.Orthography(target, ctx.function_labels[function])
+            yield from ctx.jump(target)
 
-            yield instrs.Orthography(imm, 0)
-            yield instrs.LoadProgram(call_addr, imm)
+        yield resume
+    else:
+        yield from _call_array(function, ctx)
 
     if not expr:
         return None
@@ -271,6 +357,23 @@ def _call(expr, node, ctx):
     return out
 
 
+def _call_array(function, ctx):
+    with ctx.registers.occupy() as call_addr:
+        function_address = ctx.static_allocations[function]
+        yield ctx.immediate(call_addr, function_address)
+        yield instrs.ArrayIndex(call_addr, Register.pic_table, call_addr)
+
+        resume = instrs.Label()
+        with ctx.registers.occupy() as imm:
+            yield instrs.Orthography(imm, resume)
+            yield ctx.push(imm)
+
+            yield ctx.immediate(imm, 0)
+            yield instrs.LoadProgram(call_addr, imm)
+
+    yield resume
+
+
 @compile_node.register(ast.Return)
 def _compile_return(node, ctx):
     if node.value is None:
@@ -549,6 +652,8 @@ def _assignment(node, ctx):
 
 
 def _write_static_allocations(ctx, static_allocations):
+    yield instrs.SourceLine('<init>')
+
     with ctx.registers.occupy() as imm:
         yield ctx.immediate(imm, len(static_allocations))
         yield instrs.Allocation(Register.pic_table, imm)
@@ -615,46 +720,158 @@ def _write_static_allocations(ctx, static_allocations):
         return main
 
     main = yield from inner_write_static_allocations()
+    if ctx.single_array:
+        main = next(
+            (
+                label for node, label in ctx.function_labels.items()
+                if node.name == 'main'
+            ),
+            None,
+        )
     if main is None:
         raise SyntaxError('no main function')
 
+    if ctx.single_array:
+        with ctx.registers.occupy() as target:
+            yield instrs.Orthography(target, main)
+            yield from ctx.jump(target)
+        return
+
     with ctx.registers.occupy() as imm:
         yield ctx.immediate(imm, 0)
         yield instrs.LoadProgram(main, imm)
 
 
-def _ll_instrs(it):
-    ip = 0
+def _ll_instrs(it, lines=None):
+    """Optimize, lower, and assemble the instructions yielded by ``it`` into the
+    low-level instructions of one array.
 
-    for llinstr in next(it).low_level_instructions():
-        ip += 1
-        yield llinstr
+    The ``(position, function, line)`` of each ``SourceLine`` is appended to
+    ``lines``, if given.
+    """
+    return assemble(optimize(it), lines)
 
-    while True:
-        try:
-            ir = it.send(ip)
-        except StopIteration:
-            return
 
-        for llinstr in ir.low_level_instructions():
-            ip += 1
-            yield llinstr
+def _hash_code(words):
+    """Hash a code array as the machine's ``--profile`` does: FNV-1a over whole
+    platters.
+    """
+    hash_ = 0xcbf29ce484222325
+    for word in words:
+        hash_ = ((hash_ ^ word) * 0x100000001b3) % 2 ** 64
+    return hash_
+
+
+def _code_map_entry(ll_instrs, lines):
+    """The entry in the code map for an array holding ``ll_instrs``.
+    """
+    words = [ll.raw_instruction for ll in ll_instrs]
+    return {
+        'size': len(words),
+        'hash': f'{_hash_code(words):016x}',
+        'lines': [list(line) for line in lines],
+    }
+
 
+def _to_bytes(ll_instrs):
+    return b''.join(
+        ll.raw_instruction.to_bytes(4, 'big')
+        for ll in ll_instrs
+    )
 
-def compile_ast(nodes):
+
+def _compile_single_array(nodes, static_allocations):
+    function_labels = {
+        node: instrs.Label()
+        for node in nodes
+        if isinstance(node, ast.FunctionDef)
+    }
+    ctx = Context(static_allocations, {}, function_labels=function_labels)
+
+    # compile the functions first to find the array literals they use
+    functions = [
+        (label, list(compile_node(node, ctx)))
+        for node, label in function_labels.items()
+    ]
+
+    def program():
+        yield from _write_static_allocations(ctx, static_allocations)
+        for label, body in functions:
+            yield label
+            yield from body
+
+    lines = []
+    ll_instrs = _ll_instrs(program(), lines)
+    return _to_bytes(ll_instrs), [_code_map_entry(ll_instrs, lines)]
+
+
+def compile_program(nodes, single_array=False):
+    """Compile a module to a UM program and a map of its code back to the
+    source.
+
+    Parameters
+    ----------
+    nodes : list[ast.Node]
+        The top level nodes of the module.
+    single_array : bool, optional
+        Link every function into array 0, so that calls, returns, and branches
+        are jumps within it instead of loads of another array.
+
+    Returns
+    -------
+    program : bytes
+        The program, in the big-endian format the machine loads.
+    code_map : list[dict]
+        An entry for each array of code: its ``size`` in platters, its
+        ``hash`` as the machine's ``--profile`` identifies it, and its
+        ``lines``, the ``[position, function, line]`` where the code for each
+        statement starts. ``line`` is None at the entry of a function, or of
+        the branch of an ``if``, and the code which allocates and fills the
+        arrays before ``main`` is the function ``<init>``.
+    """
     static_allocations = dict(
-        _static_allocations_without_literal_arrays(nodes),
+        _static_allocations_without_literal_arrays(nodes, single_array),
     )
+    if single_array:
+        return _compile_single_array(nodes, static_allocations)
+
     function_bodies = {}
     ctx = Context(static_allocations, function_bodies)
     for node in nodes:
         if isinstance(node, ast.FunctionDef):
-            function_bodies[node] = list(_ll_instrs(compile_node(node, ctx)))
+            function_bodies[node] = _ll_instrs(
+                compile_node(node, ctx),
+                ctx.source_lines.setdefault(node, []),
+            )
 
-    return b''.join(
-        ll.raw_instruction.to_bytes(4, 'big')
-        for ll in _ll_instrs(_write_static_allocations(
-            ctx,
-            static_allocations,
-        ))
+    lines = []
+    ll_instrs = _ll_instrs(
+        _write_static_allocations(ctx, static_allocations),
+        lines,
+    )
+    code_map = [_code_map_entry(ll_instrs, lines)]
+    code_map.extend(
+        _code_map_entry(body, ctx.source_lines[node])
+        for node, body in function_bodies.items()
     )
+    return _to_bytes(ll_instrs), code_map
+
+
+def compile_ast(nodes, single_array=False):
+    """Compile a module to a UM program.
+
+    Parameters
+    ----------
+    nodes : list[ast.Node]
+        The top level nodes of the module.
+    single_array : bool, optional
+        Link every function into array 0, so that calls, returns, and branches
+        are jumps within it instead of loads of another array.
+
+    Returns
+    -------
+    program : bytes
+        The program, in the big-endian format the machine loads.
+    """
+    program, _ = compile_program(nodes, single_array)
+    return program
@@ -15,6 +15,39 @@ class Address:
         return value
 
 
+class Label(Address):
+    """A position in a body of code, for an ``Orthography`` to load.
+
+    The position is only known once the body has been optimized, so a label is
+    placed in the instruction stream where it points and is set when the body
+    is assembled.
+    """
+    def low_level_instructions(self):
+        yield self
+
+    def __repr__(self):
+        return f'{type(self).__name__}({self.value})'
+
+
+class SourceLine:
+    """The start of the code for ``line`` of ``function``, or of the function
+    itself when ``line`` is None.
+
+    Like a ``Label``, it is placed in the instruction stream and dropped by the
+    assembler, which records where it was for the map of code back to the
+    source.
+    """
+    def __init__(self, function, line=None):
+        self.function = function
+        self.line = line
+
+    def low_level_instructions(self):
+        yield self
+
+    def __repr__(self):
+        return f'{type(self).__name__}({self.function!r}, {self.line})'
+
+
 def set_bits(n, start, count, value):
     """Set the bits in ``out`` from [start,start + count) to value.
 
@@ -131,20 +164,29 @@ class Orthography(Instruction):
     max_value = 2 ** 25 - 1
 
     def __init__(self, register, value):
-        if value > self.max_value:
-            raise ValueError(
-                f'cannot store an immediate larger'
-                f' than {self.max_value}: {value}',
-            )
+        # labels are checked when they are set
+        if not isinstance(value, Address):
+            self._check(value)
 
         self.register = register
         self.value = value
 
+    @classmethod
+    def _check(cls, value):
+        if value > cls.max_value:
+            raise ValueError(
+                f'cannot store an immediate larger'
+                f' than {cls.max_value}: {value}',
+            )
+
     @property
     def raw_instruction(self):
+        value = index(self.value)
+        self._check(value)
+
         instruction = set_bits(0, 28, 4, self.opcode)
         instruction = set_bits(instruction, 25, 3, index(self.register))
-        instruction = set_bits(instruction, 0, 25, index(self.value))
+        instruction = set_bits(instruction, 0, 25, value)
         return instruction
 
     def __repr__(self):
@@ -152,6 +194,13 @@ class Orthography(Instruction):
 
 
 class IRInstruction(object):
+    """An instruction which lowers to a fixed sequence of low-level instructions.
+
+    The sequence is built when the instruction is made, so that any scratch
+    registers it needs are taken from the register allocator while it still
+    says which registers are free at this point in the code; the optimizer may
+    then rewrite or drop the instruction before it is lowered.
+    """
     def low_level_instructions(self):
         for instr in self.instructions:
             yield from instr.low_level_instructions()
@@ -160,64 +209,57 @@ class IRInstruction(object):
 class Immediate(IRInstruction):
     def __init__(self, register, value, register_allocator):
         self.register = register
-        self.value = value
-        self.allocator = register_allocator
-
-    def low_level_instructions(self):
-        register_allocator = self.allocator
-        register = self.register
-        value = index(self.value)
-
-        quot, rem = divmod(value, Orthography.max_value)
-        if quot:
-            yield Orthography(register, quot)
+        self.value = value = index(value)
+
+        if value <= Orthography.max_value:
+            self.instructions = [Orthography(register, value)]
+        elif ~value % 2 ** 32 <= Orthography.max_value:
+            # values with the top 7 bits set, like small negative numbers, are
+            # the complement of a value which fits
+            self.instructions = [
+                Orthography(register, ~value % 2 ** 32),
+                NotAnd(register, register, register),
+            ]
+        else:
+            quot, rem = divmod(value, Orthography.max_value)
+            self.instructions = [Orthography(register, quot)]
             with register_allocator.occupy() as r:
-                yield Orthography(r, Orthography.max_value)
-                yield Multiplication(register, r, register)
+                r = index(r)
+                self.instructions.append(Orthography(r, Orthography.max_value))
+                self.instructions.append(Multiplication(register, r, register))
+                if rem:
+                    self.instructions.append(Orthography(r, rem))
+                    self.instructions.append(Addition(register, r, register))
 
-            if rem:
-                with register_allocator.occupy() as r:
-                    yield Orthography(r, rem)
-                    yield Addition(register, r, register)
-        else:
-            yield Orthography(register, rem)
+    def __repr__(self):
+        return f'{type(self).__name__}({self.register}, {self.value})'
 
 
 class Push(IRInstruction):
     def __init__(self, register, register_allocator):
         self.register = register
-        self.allocator = register_allocator
-
-    def low_level_instructions(self):
-        yield ArrayAmmendment(
-            Register.stack,
-            Register.stack_top,
-            self.register,
-        )
-
-        register_allocator = self.allocator
         with register_allocator.occupy() as imm:
-            yield from Immediate(
-                imm,
-                1,
-                register_allocator,
-            ).low_level_instructions()
-            yield Addition(Register.stack_top, Register.stack_top, imm)
+            imm = index(imm)
+            self.instructions = [
+                ArrayAmmendment(Register.stack, Register.stack_top, register),
+                Immediate(imm, 1, register_allocator),
+                Addition(Register.stack_top, Register.stack_top, imm),
+            ]
+
+    def __repr__(self):
+        return f'{type(self).__name__}({self.register})'
 
 
 class Pop(IRInstruction):
     def __init__(self, register, register_allocator):
         self.register = register
-        self.allocator = register_allocator
-
-    def low_level_instructions(self):
-        register_allocator = self.allocator
         with register_allocator.occupy() as imm:
-            yield from Immediate(
-                imm,
-                -1 % 2 ** 32,
-                register_allocator,
-            ).low_level_instructions()
-            yield Addition(Register.stack_top, Register.stack_top, imm)
-
-        yield ArrayIndex(self.register, Register.stack, Register.stack_top)
+            imm = index(imm)
+            self.instructions = [
+                Immediate(imm, -1 % 2 ** 32, register_allocator),
+                Addition(Register.stack_top, Register.stack_top, imm),
+                ArrayIndex(register, Register.stack, Register.stack_top),
+            ]
+
+    def __repr__(self):
+        return f'{type(self).__name__}({self.register})'
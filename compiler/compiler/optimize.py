@@ -0,0 +1,192 @@
+"""Peephole optimization of a body of code between the code generator and the
+assembler.
+
+The code generator emits one instruction stream per array: the IR and
+low-level instructions yielded by ``compile_node``, with ``Label``\\s at the
+places a ``LoadProgram`` returns to and ``SourceLine``\\s where the code for
+each statement starts. ``optimize`` rewrites the stream and lowers it, and
+``assemble`` sets the labels and drops them and the source lines.
+"""
+from operator import index
+
+from . import instructions as instrs
+from .runtime_constants import Register
+
+
+_stack_registers = frozenset({Register.stack, Register.stack_top})
+
+
+def _move(dst, src):
+    """Copy ``src`` into ``dst`` with no scratch register.
+    """
+    yield instrs.NotAnd(dst, src, src)
+    yield instrs.NotAnd(dst, dst, dst)
+
+
+def _peek(register):
+    """Read the top of the stack into ``register`` without popping it.
+    """
+    yield instrs.Orthography(register, 0)
+    yield instrs.NotAnd(register, register, register)
+    yield instrs.Addition(register, Register.stack_top, register)
+    yield instrs.ArrayIndex(register, Register.stack, register)
+
+
+def stack_pairs(stream):
+    """Rewrite a ``Push`` followed by a ``Pop``, and a ``Pop`` followed by a
+    ``Push`` of the same register.
+
+    A push and a pop of the same register cancel out: the value written above
+    the top of the stack is never read. A push of one register and a pop of
+    another is a move. A pop and a push of the same register is a read of the
+    top of the stack.
+
+    ``SourceLine``\\s between the two don't stop the rewrite: they stay where
+    they were in the stream, after the rewritten code.
+    """
+    out = []
+    lines = []
+    for instr in stream:
+        if isinstance(instr, instrs.SourceLine):
+            lines.append(instr)
+            continue
+
+        prev = out[-1] if out else None
+        if isinstance(prev, instrs.Push) and isinstance(instr, instrs.Pop):
+            out.pop()
+            if index(prev.register) != index(instr.register):
+                out.extend(_move(instr.register, prev.register))
+        elif (isinstance(prev, instrs.Pop) and
+                isinstance(instr, instrs.Push) and
+                index(prev.register) == index(instr.register) and
+                index(prev.register) not in _stack_registers):
+            out.pop()
+            out.extend(_peek(instr.register))
+        else:
+            out.extend(lines)
+            lines.clear()
+            out.append(instr)
+            continue
+
+        out.extend(lines)
+        lines.clear()
+
+    out.extend(lines)
+    return out
+
+
+class _KnownRegisters:
+    """The registers whose values are known at a point in a basic block.
+    """
+    def __init__(self):
+        self._values = {}
+
+    def clear(self):
+        self._values.clear()
+
+    def get(self, register):
+        return self._values.get(index(register))
+
+    def holds(self, register, value):
+        return self.get(register) == value
+
+    def _fold(self, register, f, *operands):
+        values = [self.get(r) for r in operands]
+        if None in values:
+            self._values.pop(index(register), None)
+        else:
+            self._values[index(register)] = f(*values) % 2 ** 32
+
+    def update(self, instr):
+        """Account for the effect of the low-level instruction ``instr``.
+        """
+        if isinstance(instr, (instrs.Label, instrs.LoadProgram, instrs.Halt)):
+            # jumps may land on a label with anything in the registers
+            self.clear()
+        elif isinstance(instr, instrs.Orthography):
+            value = instr.value
+            if isinstance(value, instrs.Address):
+                self._values.pop(index(instr.register), None)
+            else:
+                self._values[index(instr.register)] = value
+        elif isinstance(instr, instrs.Addition):
+            self._fold(instr.a, lambda b, c: b + c, instr.b, instr.c)
+        elif isinstance(instr, instrs.Multiplication):
+            self._fold(instr.a, lambda b, c: b * c, instr.b, instr.c)
+        elif isinstance(instr, instrs.NotAnd):
+            self._fold(instr.a, lambda b, c: ~(b & c), instr.b, instr.c)
+        elif isinstance(instr, instrs.ConditionalMove):
+            test = self.get(instr.c)
+            if test is None:
+                if not self.holds(instr.a, self.get(instr.b)):
+                    self._values.pop(index(instr.a), None)
+            elif test:
+                self._fold(instr.a, lambda b: b, instr.b)
+        elif isinstance(instr, (instrs.ArrayIndex, instrs.Division)):
+            self._values.pop(index(instr.a), None)
+        elif isinstance(instr, instrs.Allocation):
+            self._values.pop(index(instr.b), None)
+        elif isinstance(instr, instrs.Input):
+            self._values.pop(index(instr.c), None)
+
+
+def constant_loads(stream):
+    """Lower ``stream``, dropping the loads of constants into registers which
+    already hold them.
+
+    The values of the registers are followed through each basic block, so a
+    repeated ``Orthography`` or ``Immediate``, like the increment of each of a
+    run of ``Push``\\es, is only emitted once.
+    """
+    known = _KnownRegisters()
+
+    def lower(instr):
+        if isinstance(instr, instrs.Immediate):
+            if known.holds(instr.register, instr.value):
+                return
+        elif isinstance(instr, instrs.Orthography):
+            if known.holds(instr.register, instr.value):
+                return
+        if isinstance(instr, instrs.IRInstruction):
+            for subinstr in instr.instructions:
+                yield from lower(subinstr)
+            return
+
+        known.update(instr)
+        yield instr
+
+    for instr in stream:
+        yield from lower(instr)
+
+
+def optimize(stream):
+    """Optimize and lower the instructions in ``stream``.
+    """
+    return constant_loads(stack_pairs(stream))
+
+
+def assemble(stream, lines=None):
+    """Set the labels in ``stream`` to their positions and drop them and the
+    source lines.
+
+    Parameters
+    ----------
+    stream : iterable[Instruction]
+        The lowered instructions.
+    lines : list, optional
+        A list to append ``(position, function, line)`` to for each
+        ``SourceLine``; a line with no code of its own is replaced by the next.
+    """
+    out = []
+    for instr in stream:
+        if isinstance(instr, instrs.Label):
+            instr.value = len(out)
+        elif isinstance(instr, instrs.SourceLine):
+            if lines is not None:
+                if lines and lines[-1][0] == len(out):
+                    lines.pop()
+                lines.append((len(out), instr.function, instr.line))
+        else:
+            out.append(instr)
+
+    return out
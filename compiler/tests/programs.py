@@ -0,0 +1,108 @@
+"""Programs for the tests to compile, and the machine to run them on.
+
+Set ``UM`` to the binary, or build ``um`` in the root of the repository; the
+tests which run programs are skipped without one.
+"""
+import os
+import re
+import subprocess
+import tempfile
+
+
+ROOT = os.path.dirname(os.path.dirname(os.path.dirname(os.path.abspath(
+    __file__,
+))))
+
+
+# the first 15 Fibonacci numbers, computed recursively
+FIB = '''\
+def fib(n: uint) -> uint:
+    if n:
+        if n - 1:
+            x: uint = fib(n - 1)
+            y: uint = fib(n - 2)
+            return x + y
+        else:
+            return 1
+    else:
+        return 0
+
+
+def putnum(n: uint) -> void:
+    q: uint = n / 10
+    if q:
+        putnum(q)
+    else:
+        q = 0
+    um.putchar(48 + n - q * 10)
+
+
+def loop(i: uint, n: uint) -> void:
+    if n - i:
+        putnum(fib(i))
+        um.putchar(10)
+        loop(i + 1, n)
+    else:
+        i = 0
+
+
+def main() -> void:
+    loop(0, 15)
+'''
+
+
+def _fibs(count):
+    fibs = [0, 1]
+    while len(fibs) < count:
+        fibs.append(fibs[-1] + fibs[-2])
+    return fibs
+
+
+FIB_OUTPUT = b''.join(b'%d\n' % n for n in _fibs(15))
+
+
+def example():
+    with open(os.path.join(ROOT, 'compiler', 'example.uml')) as f:
+        return f.read()
+
+
+def um_binary():
+    return os.environ.get('UM', os.path.join(ROOT, 'um'))
+
+
+def have_um():
+    return os.access(um_binary(), os.X_OK)
+
+
+def engines():
+    """The engines the machine was built with."""
+    usage = subprocess.run(
+        [um_binary()],
+        stdout=subprocess.DEVNULL,
+        stderr=subprocess.PIPE,
+        text=True,
+    ).stderr
+    match = re.search(r'--engine=\{([^}]*)\}', usage)
+    return match.group(1).split(',') if match else ['switch']
+
+
+def run_program(program, engine='switch'):
+    """Run the bytes of ``program`` on ``engine``.
+
+    Returns
+    -------
+    returncode : int
+        The machine's exit status.
+    stdout : bytes
+        What the program printed.
+    """
+    with tempfile.NamedTemporaryFile(suffix='.um') as f:
+        f.write(program)
+        f.flush()
+        result = subprocess.run(
+            [um_binary(), f'--engine={engine}', '--io=batch', f.name],
+            stdin=subprocess.DEVNULL,
+            capture_output=True,
+            timeout=60,
+        )
+    return result.returncode, result.stdout
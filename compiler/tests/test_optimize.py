@@ -0,0 +1,290 @@
+"""Tests of the peephole pass in ``compiler.optimize``.
+
+The rewrites are checked by running the code before and after them on a small
+model of the machine, and whole programs by running them on the machine; see
+``tests.programs``.
+"""
+import unittest
+from unittest import mock
+
+from compiler import compiler
+from compiler import instructions as instrs
+from compiler.ast import parse
+from compiler.compiler import RegisterAllocator
+from compiler.optimize import constant_loads, optimize, stack_pairs
+from compiler.runtime_constants import Register
+
+from .programs import FIB, FIB_OUTPUT, example, have_um, run_program
+
+ax, bx, cx, dx = Register.ax, Register.bx, Register.cx, Register.dx
+
+# the handle of the stack array in `execute`
+STACK = 1
+
+
+def lower(stream):
+    """Lower ``stream`` without optimizing it."""
+    for instr in stream:
+        yield from instr.low_level_instructions()
+
+
+def execute(stream, registers=None, stack=None):
+    """Run the straight-line code in ``stream``, lowering it first.
+
+    Returns
+    -------
+    registers : list[int]
+        The registers after the code.
+    stack : list[int]
+        The stack array after the code, up to the top of the stack.
+    """
+    registers = list(registers or [0] * 8)
+    stack = list(stack or [])
+    registers[Register.stack] = STACK
+    registers[Register.stack_top] = len(stack)
+    arrays = {STACK: stack + [0] * 8}
+    for instr in lower(stream):
+        if isinstance(instr, (instrs.Label, instrs.SourceLine)):
+            continue
+        if isinstance(instr, instrs.Orthography):
+            registers[instr.register] = instr.value
+            continue
+        a, b, c = instr.a, instr.b, instr.c
+        if isinstance(instr, instrs.ConditionalMove):
+            if registers[c]:
+                registers[a] = registers[b]
+        elif isinstance(instr, instrs.ArrayIndex):
+            registers[a] = arrays[registers[b]][registers[c]]
+        elif isinstance(instr, instrs.ArrayAmmendment):
+            arrays[registers[a]][registers[b]] = registers[c]
+        elif isinstance(instr, instrs.Addition):
+            registers[a] = (registers[b] + registers[c]) % 2 ** 32
+        elif isinstance(instr, instrs.Multiplication):
+            registers[a] = (registers[b] * registers[c]) % 2 ** 32
+        elif isinstance(instr, instrs.NotAnd):
+            registers[a] = ~(registers[b] & registers[c]) % 2 ** 32
+        else:
+            raise AssertionError(f'cannot execute {instr!r}')
+    top = registers[Register.stack_top]
+    return registers, arrays[STACK][:top]
+
+
+class StackPairsTestCase(unittest.TestCase):
+    def setUp(self):
+        self.allocator = RegisterAllocator()
+
+    def push(self, register):
+        return instrs.Push(register, self.allocator)
+
+    def pop(self, register):
+        return instrs.Pop(register, self.allocator)
+
+    def assert_same_effect(self, stream, registers, stack):
+        """Check that ``stream`` leaves the registers and the stack as they
+        were without ``stack_pairs``, other than the scratch registers.
+        """
+        expected = execute(stream, registers, stack)
+        got = execute(stack_pairs(stream), registers, stack)
+        self.assertEqual(got[1], expected[1])
+        # ax..dx hold the Immediates' scratch values in the original
+        self.assertEqual(got[0][4:], expected[0][4:])
+        return got
+
+    def test_push_pop_cancel(self):
+        line = instrs.SourceLine('f', 1)
+        stream = [self.push(ax), line, self.pop(ax)]
+        self.assertEqual(stack_pairs(stream), [line])
+        self.assert_same_effect(stream, [7, 0, 0, 0, 0, 0, 0, 0], [1, 2])
+
+    def test_push_pop_move(self):
+        stream = [self.push(ax), self.pop(locals_ := Register.locals)]
+        out = stack_pairs(stream)
+        self.assertTrue(all(isinstance(i, instrs.NotAnd) for i in out), out)
+        registers, _ = self.assert_same_effect(
+            stream,
+            [0xdeadbeef, 0, 0, 0, 0, 0, 0, 0],
+            [3],
+        )
+        self.assertEqual(registers[locals_], 0xdeadbeef)
+
+    def test_pop_push_peek(self):
+        stream = [self.pop(Register.locals), self.push(Register.locals)]
+        out = stack_pairs(stream)
+        self.assertFalse(any(isinstance(i, (instrs.Push, instrs.Pop))
+                             for i in out))
+        registers, stack = self.assert_same_effect(stream, None, [4, 5, 6])
+        self.assertEqual(registers[Register.locals], 6)
+        self.assertEqual(stack, [4, 5, 6])
+
+    def test_pop_push_of_the_stack_registers(self):
+        for register in Register.stack, Register.stack_top:
+            stream = [self.pop(register), self.push(register)]
+            self.assertEqual(stack_pairs(stream), stream)
+
+    def test_separated_pairs(self):
+        stream = [
+            self.push(ax),
+            instrs.Orthography(bx, 1),
+            self.pop(ax),
+        ]
+        self.assertEqual(stack_pairs(stream), stream)
+
+        stream = [self.pop(ax), self.push(bx)]
+        self.assertEqual(stack_pairs(stream), stream)
+
+
+class ConstantLoadsTestCase(unittest.TestCase):
+    def assert_loads(self, stream, kept):
+        """Check which of the ``Orthography``\\s in ``stream``
+        ``constant_loads`` keeps.
+        """
+        out = list(constant_loads(stream))
+        for instr, keep in zip(stream, kept):
+            if isinstance(instr, instrs.Orthography):
+                self.assertEqual(any(o is instr for o in out), keep, instr)
+
+    def test_repeated_load(self):
+        stream = [instrs.Orthography(ax, 3), instrs.Orthography(ax, 3)]
+        self.assert_loads(stream, [True, False])
+
+    def test_constant_does_not_survive_label(self):
+        for barrier in (
+            instrs.Label(),
+            instrs.LoadProgram(bx, cx),
+            instrs.Halt(),
+        ):
+            stream = [
+                instrs.Orthography(ax, 3),
+                barrier,
+                instrs.Orthography(ax, 3),
+            ]
+            self.assert_loads(stream, [True, True, True])
+
+    def test_conditional_move_with_unknown_test(self):
+        stream = [
+            instrs.Orthography(ax, 1),
+            instrs.Orthography(bx, 2),
+            instrs.ConditionalMove(ax, bx, cx),
+            instrs.Orthography(ax, 1),
+        ]
+        self.assert_loads(stream, [True, True, True, True])
+
+        # either way ax holds 2
+        stream = [
+            instrs.Orthography(ax, 2),
+            instrs.Orthography(bx, 2),
+            instrs.ConditionalMove(ax, bx, cx),
+            instrs.Orthography(ax, 2),
+        ]
+        self.assert_loads(stream, [True, True, True, False])
+
+    def test_conditional_move_with_known_test(self):
+        for test, ax_value in (0, 1), (1, 2):
+            stream = [
+                instrs.Orthography(ax, 1),
+                instrs.Orthography(bx, 2),
+                instrs.Orthography(cx, test),
+                instrs.ConditionalMove(ax, bx, cx),
+                instrs.Orthography(ax, ax_value),
+                instrs.Orthography(ax, 3 - ax_value),
+            ]
+            self.assert_loads(stream, [True, True, True, True, False, True])
+
+    def test_folds_arithmetic(self):
+        stream = [
+            instrs.Orthography(bx, 2 ** 24),
+            instrs.Orthography(cx, 2 ** 9),
+            instrs.Multiplication(ax, bx, cx),
+            instrs.Orthography(dx, 0),
+            instrs.Addition(ax, ax, dx),
+        ]
+        registers, _ = execute(stream)
+        self.assertEqual(registers[ax], 0)
+        stream.append(instrs.Orthography(ax, 0))
+        self.assert_loads(stream, [True, True, True, True, True, False])
+
+    def test_unknown_results(self):
+        allocator = RegisterAllocator()
+        for clobber in (
+            instrs.ArrayIndex(ax, bx, cx),
+            instrs.Division(ax, bx, cx),
+            instrs.Allocation(ax, bx),
+            instrs.Input(0, 0, ax),
+            instrs.Orthography(ax, instrs.Label()),
+            instrs.Pop(ax, allocator),
+        ):
+            stream = [
+                instrs.Orthography(bx, 1),
+                instrs.Orthography(cx, 1),
+                instrs.Orthography(ax, 1),
+                clobber,
+                instrs.Orthography(ax, 1),
+            ]
+            self.assert_loads(stream, [True, True, True, True, True])
+
+    def test_repeated_immediate(self):
+        allocator = RegisterAllocator()
+        stream = [
+            instrs.Immediate(ax, 2 ** 30, allocator),
+            instrs.Immediate(ax, 2 ** 30, allocator),
+        ]
+        out = list(constant_loads(stream))
+        self.assertEqual(len(out), len(stream[0].instructions))
+
+
+class ImmediateTestCase(unittest.TestCase):
+    def immediate(self, value):
+        return instrs.Immediate(ax, value, RegisterAllocator())
+
+    def assert_loads(self, value, length):
+        immediate = self.immediate(value)
+        self.assertEqual(len(immediate.instructions), length, value)
+        registers, _ = execute(optimize([immediate]))
+        self.assertEqual(registers[ax], value)
+
+    def test_fits(self):
+        for value in 0, 1, instrs.Orthography.max_value:
+            self.assert_loads(value, 1)
+
+    def test_complement(self):
+        for value in (
+            2 ** 32 - 1,
+            -5 % 2 ** 32,
+            ~instrs.Orthography.max_value % 2 ** 32,
+        ):
+            self.assert_loads(value, 2)
+
+    def test_over_25_bits(self):
+        for value, length in (
+            (instrs.Orthography.max_value + 1, 5),
+            (instrs.Orthography.max_value * 2, 3),
+            (0xdeadbeef, 5),
+            # the complement is one too large
+            (~(instrs.Orthography.max_value + 1) % 2 ** 32, 5),
+        ):
+            self.assert_loads(value, length)
+
+
+@unittest.skipUnless(have_um(), 'no um binary')
+class ProgramTestCase(unittest.TestCase):
+    """Compile programs with and without the peephole pass and check that
+    they print the same.
+    """
+    def assert_same_output(self, source, expected):
+        tree = parse(source)
+        optimized = compiler.compile_ast(tree)
+        with mock.patch.object(compiler, 'optimize', lower):
+            unoptimized = compiler.compile_ast(tree)
+        self.assertLess(len(optimized), len(unoptimized))
+        self.assertEqual(run_program(optimized), (0, expected))
+        self.assertEqual(run_program(unoptimized), (0, expected))
+
+    def test_fib(self):
+        self.assert_same_output(FIB, FIB_OUTPUT)
+
+    def test_example(self):
+        self.assert_same_output(example(), b'hello world\n')
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,33 @@
+"""Tests of the ``--single-array`` layout, which links every function into
+array 0 and turns calls, returns and branches into jumps within it.
+"""
+import unittest
+
+from compiler.ast import parse
+from compiler.compiler import compile_ast
+
+from .programs import FIB, FIB_OUTPUT, engines, example, have_um, run_program
+
+
+@unittest.skipUnless(have_um(), 'no um binary')
+class SingleArrayTestCase(unittest.TestCase):
+    """Check that a program prints the same in either layout on every engine.
+    """
+    def assert_same_output(self, source, expected):
+        tree = parse(source)
+        default = compile_ast(tree)
+        single_array = compile_ast(tree, single_array=True)
+        self.assertNotEqual(single_array, default)
+        for engine in engines():
+            with self.subTest(engine=engine):
+                self.assertEqual(run_program(default, engine), (0, expected))
+                self.assertEqual(
+                    run_program(single_array, engine),
+                    (0, expected),
+                )
+
+    def test_fib(self):
+        self.assert_same_output(FIB, FIB_OUTPUT)
+
+    def test_example(self):
+        self.assert_same_output(example(), b'hello world\n')
@@ -0,0 +1,95 @@
+"""Read the opcode traces written by a ``make TRACE_OP_CODES=PATH`` build.
+
+A trace starts with the magic ``UMTRACE`` and a byte of the version; see
+``trace_version`` in ``machine/src/trace.h``. Version 1 is a run of blocks,
+each a little-endian count of opcodes, the size of the payload, and the
+payload: the opcodes packed two to a byte, the first in the low nibble, and
+compressed with zlib. Traces without the magic are version 0, one opcode per
+byte, as the tracer wrote them before.
+"""
+import struct
+import zlib
+
+MAGIC = b'UMTRACE'
+VERSION = 1
+
+_BLOCK_HEADER = struct.Struct('<II')
+_LOW = bytes(b & 0xf for b in range(256))
+_HIGH = bytes(b >> 4 for b in range(256))
+
+# the size of the reads of a version 0 trace
+_CHUNK_SIZE = 1 << 24
+
+
+def _version(f):
+    """Read the header of the trace ``f`` and return its version and any bytes
+    read which turned out to be opcodes.
+    """
+    header = f.read(len(MAGIC) + 1)
+    if header[:len(MAGIC)] != MAGIC:
+        return 0, header
+
+    version = header[len(MAGIC)]
+    if version > VERSION:
+        raise ValueError(f'unknown trace version: {version}')
+    return version, b''
+
+
+def _blocks(f):
+    """Yield the opcode count and payload of each block of a version 1 trace.
+    """
+    while True:
+        header = f.read(_BLOCK_HEADER.size)
+        if not header:
+            return
+        if len(header) != _BLOCK_HEADER.size:
+            raise ValueError('truncated trace')
+        count, size = _BLOCK_HEADER.unpack(header)
+        payload = f.read(size)
+        if len(payload) != size:
+            raise ValueError('truncated trace')
+        yield count, payload
+
+
+def _unpack(count, payload):
+    packed = zlib.decompress(payload)
+    ops = bytearray(2 * len(packed))
+    ops[0::2] = packed.translate(_LOW)
+    ops[1::2] = packed.translate(_HIGH)
+    del ops[count:]
+    return bytes(ops)
+
+
+def _chunks(f, data):
+    """Yield the opcodes of a version 0 trace, starting with ``data``.
+    """
+    if data:
+        yield data
+    while True:
+        chunk = f.read(_CHUNK_SIZE)
+        if not chunk:
+            return
+        yield chunk
+
+
+def read_opcodes(f):
+    """Yield the opcodes in the trace ``f``, a binary file, in chunks of bytes
+    with one opcode each.
+    """
+    version, data = _version(f)
+    if version == 0:
+        yield from _chunks(f, data)
+        return
+
+    for count, payload in _blocks(f):
+        yield _unpack(count, payload)
+
+
+def count_opcodes(f):
+    """Count the opcodes in the trace ``f`` without decompressing it.
+    """
+    version, data = _version(f)
+    if version == 0:
+        return sum(len(chunk) for chunk in _chunks(f, data))
+
+    return sum(count for count, _ in _blocks(f))
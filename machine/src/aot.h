@@ -0,0 +1,169 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <string>
+
+#include "decoded_program.h"
+#include "opcode.h"
+
+namespace um {
+/** A program translated to C++ ahead of time by `um --translate` and built into
+    the machine with `make AOT_PROGRAM=PATH`, for `--engine=aot`.
+
+    The translation of an image holds the image itself, so that the engine can
+    check that array 0 is the image it was translated from, and `run()`: every
+    instruction in array 0 becomes a label and a line of C++ on the registers, kept
+    in locals, and a `load_program` of array 0 goes through a table of the labels.
+    Anything else which changes the finger or may stop, and which the engine
+    must do itself, returns from `run()` with the finger at that instruction:
+    `halt`, `input`, the invalid opcodes, a `load_program` of another array, an
+    `array_amendment` of array 0, and a jump past the end.
+ */
+struct translated_program {
+#ifdef UM_AOT_PROGRAM
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
+
+    static const platter image[];
+    static const std::size_t size;
+
+    /** Run the translation from `finger` until it reaches an instruction it leaves
+        to the engine.
+     */
+    template<typename Machine>
+    static void run(Machine& m, std::array<platter, 8>& registers, std::size_t& finger);
+};
+
+namespace detail {
+/** Write the C++ for the instruction at `ix` in the body of
+    `translated_program::run()`.
+ */
+inline void translate_instruction(std::ostream& out, std::size_t ix, platter p) {
+    decoded_instruction i = decoded_instruction::decode(p);
+    auto r = [](int ix) { return "r" + std::to_string(ix); };
+    std::string a = r(i.a);
+    std::string b = r(i.b);
+    std::string c = r(i.c);
+    // leave the instruction to the engine, which counts it
+    std::string stop = "finger = " + std::to_string(ix) + "; goto out;";
+    std::string count = "m.m_trace_ops(" + std::to_string(i.op) + "); m.m_stats.op(" +
+                        std::to_string(i.op) + "); m.m_profiler.sample(m.m_arrays, " +
+                        std::to_string(ix) + ");\n    ";
+
+    out << "i" << ix << ":\n    ";
+    switch (static_cast<opcode>(i.op)) {
+    case opcode::array_amendment:
+        out << "if (!" << a << ") { " << stop << " }\n    " << count;
+        break;
+    case opcode::load_program:
+        out << "if (" << b << ") { " << stop << " }\n    " << count;
+        break;
+    case opcode::halt:
+    case opcode::input:
+        break;
+    default:
+        if (i.op < 14) {
+            out << count;
+        }
+        break;
+    }
+    switch (static_cast<opcode>(i.op)) {
+    case opcode::conditional_move:
+        out << "if (" << c << ") { " << a << " = " << b << "; }";
+        break;
+    case opcode::array_index:
+        out << a << " = m.m_arrays[" << b << "][" << c << "];";
+        break;
+    case opcode::array_amendment:
+        out << "m.m_arrays.amend(" << a << ", " << b << ", " << c << ");";
+        break;
+    case opcode::addition:
+        out << a << " = " << b << " + " << c << ";";
+        break;
+    case opcode::multiplication:
+        out << a << " = " << b << " * " << c << ";";
+        break;
+    case opcode::division:
+        out << a << " = " << b << " / " << c << ";";
+        break;
+    case opcode::not_and:
+        out << a << " = ~(" << b << " & " << c << ");";
+        break;
+    case opcode::allocation:
+        out << b << " = m.allocate_array(" << c << ");";
+        break;
+    case opcode::abandonment:
+        out << "m.abandon_array(" << c << ");";
+        break;
+    case opcode::output:
+        out << "m.m_io.put(" << c << ");";
+        break;
+    case opcode::load_program:
+        out << "m.m_stats.load_program(0);\n    "
+            << "finger = " << c << ";\n    "
+            << "goto* labels[finger < size ? finger : size];";
+        break;
+    case opcode::orthography:
+        out << a << " = " << i.value << ";";
+        break;
+    default:
+        // halt, input, and the invalid opcodes
+        out << stop;
+        break;
+    }
+    out << '\n';
+}
+}  // namespace detail
+
+/** Write a translation of the `size` instructions of `program`, which is indexed
+    like the store's `program()` view, to `out` for `make AOT_PROGRAM=`.
+ */
+template<typename Program>
+void translate_program(const Program& program, std::size_t size, std::ostream& out) {
+    out << "// Generated by `um --translate`; do not edit by hand.\n"
+           "#pragma once\n\n"
+           "#include <array>\n\n"
+           "#include \"aot.h\"\n\n"
+           "namespace um {\n"
+           "const std::size_t translated_program::size = "
+        << size << ";\n\n"
+        << "const platter translated_program::image[] = {";
+    for (std::size_t ix = 0; ix < size; ++ix) {
+        char word[16];
+        std::snprintf(word, sizeof(word), "0x%08x,", program[ix]);
+        out << (ix % 6 ? " " : "\n    ") << word;
+    }
+    out << "\n};\n\n"
+           "template<typename Machine>\n"
+           "void translated_program::run(Machine& m,\n"
+           "                             std::array<platter, 8>& registers,\n"
+           "                             std::size_t& finger) {\n"
+           "    static void* const labels[] = {";
+    // the last label is the end of array 0
+    for (std::size_t ix = 0; ix <= size; ++ix) {
+        out << (ix % 8 ? " " : "\n        ") << "&&i" << ix << ",";
+    }
+    out << "\n    };\n\n";
+    for (int r = 0; r < 8; ++r) {
+        out << "    platter r" << r << " = registers[" << r << "];\n";
+    }
+    out << "    goto* labels[finger];\n\n";
+    for (std::size_t ix = 0; ix < size; ++ix) {
+        detail::translate_instruction(out, ix, program[ix]);
+    }
+    out << "i" << size << ":\n"
+        << "    finger = size;\n"
+           "out:\n";
+    for (int r = 0; r < 8; ++r) {
+        out << "    registers[" << r << "] = r" << r << ";\n";
+    }
+    out << "}\n"
+           "}  // namespace um\n";
+}
+}  // namespace um
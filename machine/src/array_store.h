@@ -0,0 +1,950 @@
+#pragma once
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include "cow_vector.h"
+#include "memory_mapping.h"
+#include "opcode.h"
+#include "program_image.h"
+#include "snapshot.h"
+
+namespace um {
+/** An allocator for `std::vector` which aligns its storage to `alignment`.
+ */
+template<typename T, std::size_t alignment>
+struct aligned_allocator {
+    using value_type = T;
+
+    template<typename U>
+    struct rebind {
+        using other = aligned_allocator<U, alignment>;
+    };
+
+    aligned_allocator() = default;
+
+    template<typename U>
+    aligned_allocator(const aligned_allocator<U, alignment>&) {}
+
+    T* allocate(std::size_t count) {
+        return static_cast<T*>(
+            ::operator new(count * sizeof(T), std::align_val_t(alignment)));
+    }
+
+    void deallocate(T* p, std::size_t) {
+        ::operator delete(p, std::align_val_t(alignment));
+    }
+
+    template<typename U>
+    bool operator==(const aligned_allocator<U, alignment>&) const {
+        return true;
+    }
+
+    template<typename U>
+    bool operator!=(const aligned_allocator<U, alignment>&) const {
+        return false;
+    }
+};
+
+/** An allocator for `std::vector` which gets its storage from `calloc` and leaves
+    value initialized elements alone, so a large vector of zeros is made from fresh
+    pages which the kernel zeroes as they are touched instead of filled up front.
+ */
+template<typename T>
+struct zeroed_allocator {
+    using value_type = T;
+
+    zeroed_allocator() = default;
+
+    template<typename U>
+    zeroed_allocator(const zeroed_allocator<U>&) {}
+
+    T* allocate(std::size_t count) {
+        void* out = std::calloc(count, sizeof(T));
+        if (!out) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(out);
+    }
+
+    void deallocate(T* p, std::size_t) {
+        std::free(p);
+    }
+
+    /** Value initialization; the storage is already zero.
+     */
+    template<typename U>
+    void construct(U* p) {
+        ::new (static_cast<void*>(p)) U;
+    }
+
+    template<typename U, typename... Args>
+    void construct(U* p, Args&&... args) {
+        ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+
+    template<typename U>
+    bool operator==(const zeroed_allocator<U>&) const {
+        return true;
+    }
+
+    template<typename U>
+    bool operator!=(const zeroed_allocator<U>&) const {
+        return false;
+    }
+};
+
+#ifdef UM_USE_COW_VECTOR
+template<typename T>
+using array_vector = cow_vector<T>;
+#else
+template<typename T>
+using array_vector = std::vector<T, zeroed_allocator<T>>;
+#endif
+
+/** A program which the stores of many machines, on any threads, use as their
+    array 0 without copying it, as the jobs of `--batch` do. A store copies array
+    0 when it is first written to; with `COW_VECTOR=1`, only the chunks written.
+
+    The stores keep a reference to it, so it outlives them.
+ */
+class shared_program {
+private:
+    std::vector<platter> m_platters;
+#ifdef UM_USE_COW_VECTOR
+    // the same platters, for the vector store's arrays to share chunks with
+    cow_vector<platter> m_chunks;
+#endif
+
+public:
+    explicit shared_program(std::vector<platter>&& platters)
+        : m_platters(std::move(platters)) {
+#ifdef UM_USE_COW_VECTOR
+        m_chunks = cow_vector<platter>(m_platters);
+        m_chunks.pin();
+#endif
+    }
+
+    shared_program(const shared_program&) = delete;
+    shared_program& operator=(const shared_program&) = delete;
+
+#ifdef UM_USE_COW_VECTOR
+    ~shared_program() {
+        m_chunks.unpin();
+    }
+
+    /** The platters as pinned chunks, which copies share.
+     */
+    const cow_vector<platter>& chunks() const {
+        return m_chunks;
+    }
+#endif
+
+    const platter* data() const {
+        return m_platters.data();
+    }
+
+    std::size_t size() const {
+        return m_platters.size();
+    }
+};
+
+/** The machine's arrays, each its own `array_vector`.
+
+    Abandoned arrays are cleared and their index is reused by a later allocation.
+    Free indices are kept on a list for each power of two class of the capacity
+    their storage keeps, and an allocation takes one whose storage fits without
+    being more than `max_free_overshoot` classes too big, or else gives one with
+    no storage worth keeping a fresh vector, so a small array never pins a huge
+    buffer and a big one never grows a small buffer a little at a time.
+
+    Arrays with a capacity of at least `lazy_zero_size` platters give their storage
+    back instead of keeping it: new arrays of zeros come from memory the kernel
+    zeroes on first touch, so a large array which is abandoned and reallocated
+    doesn't pay to be zeroed again. So does any array which would take the storage
+    kept by free indices past `max_retained_size` platters.
+
+    `load()` doesn't copy: array 0 becomes an alias of the loaded array until
+    either of them is amended or the source is abandoned. While it is an alias the
+    slot for array 0 is left alone, so unsharing can reuse its capacity. A
+    `shared_program` is used the same way until array 0 is amended.
+ */
+class vector_array_store {
+public:
+    /** The arrays are allocated by `array_vector`, so mapping options don't apply.
+     */
+    static constexpr bool maps_memory = false;
+    static inline mapping_options options;
+
+    static constexpr std::size_t lazy_zero_size = 1 << 16;
+    static constexpr std::size_t max_retained_size = 1 << 24;
+    static constexpr std::size_t max_free_overshoot = 2;
+
+#ifdef UM_USE_COW_VECTOR
+    using program_view = cow_vector<platter>::view;
+    using array_view = const array_vector<platter>&;
+#else
+    using program_view = const platter*;
+    using array_view = const platter*;
+#endif
+
+private:
+    // free indices by `capacity_class()` of their storage's capacity
+    std::array<std::vector<platter>, 17> m_free_lists;
+    // the capacity kept by free indices
+    std::size_t m_retained = 0;
+    std::vector<array_vector<platter>> m_arrays;
+
+    // the array which array 0 is an alias of, or 0 if it has its own contents
+    platter m_program_source = 0;
+
+#ifdef UM_USE_COW_VECTOR
+    // the program whose chunks array 0 was made with, which must outlive them
+    std::shared_ptr<const shared_program> m_shared_program;
+
+    const array_vector<platter>& slot(platter address) const {
+        return m_arrays[address ? address : m_program_source];
+    }
+
+    /** Give array 0 its own copy of its source.
+     */
+    void unshare() {
+        m_arrays[0] = m_arrays[m_program_source];
+        m_program_source = 0;
+    }
+#else
+    // the program array 0 still is, while the slot for array 0 is empty
+    std::shared_ptr<const shared_program> m_shared_program;
+    // the contents of array 0, wherever they are
+    const platter* m_program = nullptr;
+
+    const platter* data(platter address) const {
+        return address ? m_arrays[address].data() : m_program;
+    }
+
+    /** Give array 0 its own copy of its source or of the shared program.
+     */
+    void unshare() {
+        if (m_shared_program) {
+            m_arrays[0].assign(m_shared_program->data(),
+                               m_shared_program->data() + m_shared_program->size());
+            m_shared_program.reset();
+        }
+        else {
+            m_arrays[0] = m_arrays[m_program_source];
+        }
+        m_program = m_arrays[0].data();
+        m_program_source = 0;
+    }
+#endif
+
+    /** 0 for 0, else one more than the floor of the log base 2 of `size`.
+     */
+    static std::size_t capacity_class(std::size_t size) {
+        return size ? 64 - __builtin_clzll(size) : 0;
+    }
+
+    /** The storage `array` keeps when it is cleared.
+     */
+    static std::size_t retained(const array_vector<platter>& array) {
+#ifdef UM_USE_COW_VECTOR
+        // clearing releases every chunk
+        static_cast<void>(array);
+        return 0;
+#else
+        return array.capacity();
+#endif
+    }
+
+    platter take_free(std::vector<platter>& free_list) {
+        platter address = free_list.back();
+        free_list.pop_back();
+        m_retained -= retained(m_arrays[address]);
+        return address;
+    }
+
+public:
+    explicit vector_array_store(std::vector<platter>&& program) {
+#ifdef UM_USE_COW_VECTOR
+        m_arrays.emplace_back(program);
+#else
+        m_arrays.emplace_back(program.begin(), program.end());
+        m_program = m_arrays[0].data();
+#endif
+    }
+
+    explicit vector_array_store(std::shared_ptr<const shared_program> program)
+        : m_shared_program(std::move(program)) {
+#ifdef UM_USE_COW_VECTOR
+        m_arrays.emplace_back(m_shared_program->chunks());
+#else
+        m_arrays.emplace_back();
+        m_program = m_shared_program->data();
+#endif
+    }
+
+    explicit vector_array_store(program_image&& program) {
+        m_arrays.emplace_back(program.size());
+#ifdef UM_USE_COW_VECTOR
+        for (std::size_t ix = 0; ix < program.size();) {
+            auto [data, count] = m_arrays[0].chunk_data(ix);
+            program.copy_to(data, ix, count);
+            ix += count;
+        }
+#else
+        program.copy_to(m_arrays[0].data());
+        m_program = m_arrays[0].data();
+#endif
+    }
+
+    explicit vector_array_store(snapshot&& saved) {
+        m_free_lists[0] = saved.free_handles();
+        const platter* contents = saved.contents();
+        for (std::size_t address = 0; address < saved.array_count(); ++address) {
+            std::size_t size = saved.size(address);
+            auto& array = m_arrays.emplace_back(size);
+#ifdef UM_USE_COW_VECTOR
+            for (std::size_t ix = 0; ix < size;) {
+                auto [data, count] = array.chunk_data(ix);
+                std::memcpy(data, contents + ix, count * sizeof(platter));
+                ix += count;
+            }
+#else
+            std::memcpy(array.data(), contents, size * sizeof(platter));
+#endif
+            contents += size;
+        }
+#ifndef UM_USE_COW_VECTOR
+        m_program = m_arrays[0].data();
+#endif
+    }
+
+    /** Read access to the array at `address`; writes go through `amend()`.
+     */
+    array_view operator[](platter address) const {
+#ifdef UM_USE_COW_VECTOR
+        return slot(address);
+#else
+        return data(address);
+#endif
+    }
+
+    /** Write `value` to `index` of the array at `address`.
+
+        @return Whether array 0 had to be given its own copy, which invalidates any
+                `program()` view.
+     */
+    bool amend(platter address, platter index, platter value) {
+#ifdef UM_USE_COW_VECTOR
+        bool moved = m_program_source && (address == 0 || address == m_program_source);
+#else
+        bool moved = (m_program_source || m_shared_program) &&
+                     (address == 0 || address == m_program_source);
+#endif
+        if (moved) {
+            unshare();
+        }
+        m_arrays[address][index] = value;
+        return moved;
+    }
+
+    /** The array which array 0 is an alias of, or 0 if it has been copied or
+        written to since the last `load()`.
+     */
+    platter program_source() const {
+        return m_program_source;
+    }
+
+    /** A read-only view of array 0 for the engines to fetch instructions through.
+
+        This stays valid across `abandon()` and across writes to array 0, except
+        where `amend()` says otherwise, but not across `load()`.
+     */
+    program_view program() const {
+#ifdef UM_USE_COW_VECTOR
+        return slot(0).read_view();
+#else
+        return m_program;
+#endif
+    }
+
+    std::size_t size(platter address) const {
+#ifdef UM_USE_COW_VECTOR
+        return slot(address).size();
+#else
+        if (!address && m_shared_program) {
+            return m_shared_program->size();
+        }
+        return m_arrays[address ? address : m_program_source].size();
+#endif
+    }
+
+    /** The number of array handles, live or free.
+     */
+    std::size_t array_count() const {
+        return m_arrays.size();
+    }
+
+    std::vector<platter> free_handles() const {
+        std::vector<platter> out;
+        for (const std::vector<platter>& free_list : m_free_lists) {
+            out.insert(out.end(), free_list.begin(), free_list.end());
+        }
+        return out;
+    }
+
+    mapping_stats memory() const {
+        return {};
+    }
+
+    /** Call `f(data, count)` over the contents of the array at `address`, in order.
+     */
+    template<typename F>
+    void read(platter address, F&& f) const {
+#ifdef UM_USE_COW_VECTOR
+        const array_vector<platter>& array = slot(address);
+        for (std::size_t ix = 0; ix < array.size();) {
+            auto [data, count] = array.chunk_data(ix);
+            f(data, count);
+            ix += count;
+        }
+#else
+        f(data(address), size(address));
+#endif
+    }
+
+    /** Write `value` to the `count` platters of the array at `address` from
+        `index`, like `count` calls to `amend()`. The array must not be array 0 or
+        its source.
+     */
+    void fill(platter address, platter index, platter count, platter value) {
+        array_vector<platter>& array = m_arrays[address];
+#ifdef UM_USE_COW_VECTOR
+        for (std::size_t ix = index, end = std::size_t(index) + count; ix < end;) {
+            auto [data, length] = array.chunk_data(ix);
+            std::size_t offset = ix & cow_vector<platter>::chunk_mask;
+            std::size_t n = std::min(length - offset, end - ix);
+            std::fill_n(data + offset, n, value);
+            ix += n;
+        }
+#else
+        std::fill_n(array.data() + index, count, value);
+#endif
+    }
+
+    /** Copy the `count` platters from `index` of the array at `source` to the same
+        place in the array at `destination`, which must not be array 0 or its
+        source.
+     */
+    void copy(platter destination, platter source, platter index, platter count) {
+        if (destination == source) {
+            return;
+        }
+        array_vector<platter>& to = m_arrays[destination];
+#ifdef UM_USE_COW_VECTOR
+        const array_vector<platter>& from = slot(source);
+        // the chunks of the two line up
+        for (std::size_t ix = index, end = std::size_t(index) + count; ix < end;) {
+            auto [data, length] = to.chunk_data(ix);
+            std::size_t offset = ix & cow_vector<platter>::chunk_mask;
+            std::size_t n = std::min(length - offset, end - ix);
+            std::memcpy(data + offset,
+                        from.chunk_data(ix).first + offset,
+                        n * sizeof(platter));
+            ix += n;
+        }
+#else
+        std::memcpy(to.data() + index, data(source) + index, count * sizeof(platter));
+#endif
+    }
+
+    platter allocate(platter size) {
+        std::size_t first = capacity_class(size);
+        std::size_t last = std::min(first + max_free_overshoot, m_free_lists.size() - 1);
+        for (std::size_t c = first; c <= last; ++c) {
+            std::vector<platter>& free_list = m_free_lists[c];
+            if (free_list.size() && retained(m_arrays[free_list.back()]) >= size) {
+                platter address = take_free(free_list);
+#ifdef UM_USE_COW_VECTOR
+                m_arrays[address].resize(size, 0);
+#else
+                m_arrays[address].assign(size, 0);
+#endif
+                return address;
+            }
+        }
+
+        // nothing kept fits, so replace the storage of the index which keeps least
+        for (std::vector<platter>& free_list : m_free_lists) {
+            if (free_list.size()) {
+                platter address = take_free(free_list);
+                m_arrays[address] = array_vector<platter>(size);
+                return address;
+            }
+        }
+
+        m_arrays.emplace_back(size);
+        return m_arrays.size() - 1;
+    }
+
+    void abandon(platter address) {
+        if (address == m_program_source) {
+            // array 0 is the only one left using the contents, so it can have them
+            std::swap(m_arrays[0], m_arrays[address]);
+            m_program_source = 0;
+        }
+        auto& array = m_arrays[address];
+        std::size_t capacity = retained(array);
+        if (capacity >= lazy_zero_size || m_retained + capacity > max_retained_size) {
+            array = array_vector<platter>();
+            capacity = 0;
+        }
+        else {
+            array.clear();
+        }
+        m_retained += capacity;
+        m_free_lists[capacity_class(capacity)].push_back(address);
+    }
+
+    /** Replace array 0 with the array at `address`, without copying it.
+     */
+    void load(platter address) {
+        m_program_source = address;
+#ifndef UM_USE_COW_VECTOR
+        m_shared_program.reset();
+        m_program = m_arrays[address].data();
+#endif
+    }
+};
+
+/** The machine's arrays, carved out of memory the store owns.
+
+    Arrays are rounded up to a power of two size class. Classes up to
+    `max_slab_class` are cut from `slab_size` slabs, larger ones straight from a
+    bump arena; either way, abandoned blocks go on a free list for their class and
+    the next allocation of that class reuses them. Arrays are named by 32 bit
+    handles which index a table of base pointers, so `allocation` and
+    `abandonment` never call into the system allocator once the program has warmed
+    up. The sizes are kept in a table of their own: `array_index` and
+    `array_amendment` only need the base pointer, so this way a cache line holds
+    the pointers for eight arrays instead of four {data, size} pairs.
+
+    Blocks of `min_lazy_class` and up aren't zeroed by `allocation`: they come from
+    fresh mappings, and `abandonment` gives their pages back to the kernel, which
+    zero fills them when they are next touched. A large array only costs memory
+    for the pages the program uses.
+
+    Blocks too big for a slab of at least `options.huge_page_threshold` bytes can
+    come from a second arena of huge pages, and every mapping can be bound to the
+    NUMA node the store was made on; see `mapping_options`.
+
+    `load()` points array 0 at the source's block, and the block is only
+    copied when one of them is amended.
+ */
+class slab_array_store {
+public:
+    /** The smallest block holds a free list link.
+     */
+    static constexpr std::size_t min_class = 1;
+    static constexpr std::size_t max_slab_class = 12;
+    /** Free blocks of at least this class are handed back to the kernel with
+        `MADV_DONTNEED`, and so are zero but for their free list link.
+     */
+    static constexpr std::size_t min_lazy_class = 16;
+    static constexpr std::size_t slab_size = 1 << 16;
+    static constexpr std::size_t arena_chunk_size = 64 << 20;
+
+    static constexpr bool maps_memory = true;
+
+    /** How the stores made from now on map their memory. Set this before making
+        any machines.
+     */
+    static inline mapping_options options;
+
+private:
+    union free_block {
+        free_block* next;
+        platter platters[2];
+    };
+    static_assert(sizeof(free_block) == sizeof(platter) << min_class);
+
+    std::vector<platter*, aligned_allocator<platter*, 64>> m_data;
+    std::vector<platter> m_sizes;
+    std::vector<platter> m_free_handles;
+    std::array<free_block*, 33> m_free_blocks{};
+
+    memory_mapper m_mapper{options};
+    std::uint8_t* m_arena = nullptr;
+    std::size_t m_arena_remaining = 0;
+    std::uint8_t* m_huge_arena = nullptr;
+    std::size_t m_huge_arena_remaining = 0;
+    std::vector<std::pair<void*, std::size_t>> m_chunks;
+
+    // array 0 as mapped from the program image, until it is replaced
+    program_image::mapped_program m_mapped_program = {};
+
+    // the arrays restored from a snapshot, which stays mapped until we are destroyed
+    snapshot::mapping m_snapshot = {nullptr, 0};
+
+    // the program array 0 still is, until it is amended or replaced
+    std::shared_ptr<const shared_program> m_shared_program;
+
+    // the array whose block array 0 shares, or 0 if it has its own
+    platter m_program_source = 0;
+
+    /** Give array 0 its own copy of its source or of the shared program.
+     */
+    void unshare() {
+        platter* data = new_array(m_sizes[0]);
+        if (m_sizes[0]) {
+            std::memcpy(data, m_data[0], m_sizes[0] * sizeof(platter));
+        }
+        m_data[0] = data;
+        m_shared_program.reset();
+        m_program_source = 0;
+    }
+
+    /** Whether `data` points into a mapping instead of a block we allocated.
+     */
+    bool mapped(const platter* data) const {
+        auto* bytes = reinterpret_cast<const std::uint8_t*>(data);
+        auto* snapshot_begin = static_cast<const std::uint8_t*>(m_snapshot.data);
+        return data == m_mapped_program.platters ||
+               (bytes >= snapshot_begin && bytes < snapshot_begin + m_snapshot.size);
+    }
+
+    static std::size_t size_class(std::size_t size) {
+        if (size <= (1 << min_class)) {
+            return min_class;
+        }
+        return 64 - __builtin_clzll(size - 1);
+    }
+
+    void* bump(std::size_t bytes) {
+        if (bytes > m_arena_remaining) {
+            std::size_t chunk_size = std::max(bytes, arena_chunk_size);
+            void* chunk = m_mapper.map_normal(chunk_size);
+            m_chunks.emplace_back(chunk, chunk_size);
+            m_arena = static_cast<std::uint8_t*>(chunk);
+            m_arena_remaining = chunk_size;
+        }
+        void* out = m_arena;
+        m_arena += bytes;
+        m_arena_remaining -= bytes;
+        return out;
+    }
+
+    /** `bump()` from the huge page arena. Blocks are powers of two, so the ones of
+        at least a huge page stay aligned to one.
+     */
+    void* bump_huge(std::size_t bytes) {
+        if (bytes > m_huge_arena_remaining) {
+            std::size_t page = mapping_options::huge_page_size;
+            std::size_t chunk_size =
+                std::max((bytes + page - 1) & ~(page - 1), arena_chunk_size);
+            void* chunk = m_mapper.map_huge(chunk_size);
+            m_chunks.emplace_back(chunk, chunk_size);
+            m_huge_arena = static_cast<std::uint8_t*>(chunk);
+            m_huge_arena_remaining = chunk_size;
+        }
+        void* out = m_huge_arena;
+        m_huge_arena += bytes;
+        m_huge_arena_remaining -= bytes;
+        return out;
+    }
+
+    /** Carve a new slab into blocks of class `cls` and put them on its free list.
+     */
+    void refill(std::size_t cls) {
+        std::size_t block_size = sizeof(platter) << cls;
+        auto* slab = static_cast<std::uint8_t*>(bump(slab_size));
+        for (std::size_t offset = slab_size; offset;) {
+            offset -= block_size;
+            auto* block = reinterpret_cast<free_block*>(slab + offset);
+            block->next = m_free_blocks[cls];
+            m_free_blocks[cls] = block;
+        }
+    }
+
+    platter* allocate_block(std::size_t cls) {
+        if (!m_free_blocks[cls]) {
+            if (cls <= max_slab_class) {
+                refill(cls);
+            }
+            else {
+                std::size_t bytes = sizeof(platter) << cls;
+                return static_cast<platter*>(m_mapper.wants_huge(bytes) ? bump_huge(bytes)
+                                                                       : bump(bytes));
+            }
+        }
+        free_block* block = m_free_blocks[cls];
+        m_free_blocks[cls] = block->next;
+        return block->platters;
+    }
+
+    void release_block(platter* data, std::size_t size) {
+        if (!data) {
+            return;
+        }
+        if (data == m_mapped_program.platters) {
+            munmap(m_mapped_program.mapping, m_mapped_program.mapping_size);
+            m_mapped_program = {};
+            return;
+        }
+        if (m_shared_program && data == m_shared_program->data()) {
+            m_shared_program.reset();
+            return;
+        }
+        if (mapped(data)) {
+            return;
+        }
+        auto* block = reinterpret_cast<free_block*>(data);
+        std::size_t cls = size_class(size);
+        if (cls >= min_lazy_class) {
+            // large blocks are page aligned, but a hugetlb mapping refuses anything
+            // short of a whole huge page
+            std::size_t bytes = sizeof(platter) << cls;
+            if (madvise(data, bytes, MADV_DONTNEED)) {
+                std::memset(data, 0, bytes);
+            }
+        }
+        block->next = m_free_blocks[cls];
+        m_free_blocks[cls] = block;
+    }
+
+    platter* new_array(std::size_t size) {
+        if (!size) {
+            return nullptr;
+        }
+        return allocate_block(size_class(size));
+    }
+
+public:
+    using program_view = const platter*;
+
+    explicit slab_array_store(const std::vector<platter>& program) {
+        std::size_t size = program.size();
+        platter* data = new_array(size);
+        if (size) {
+            std::memcpy(data, program.data(), size * sizeof(platter));
+        }
+        m_data.push_back(data);
+        m_sizes.push_back(size);
+    }
+
+    /** Use the program as array 0 until it is amended, instead of copying it.
+     */
+    explicit slab_array_store(std::shared_ptr<const shared_program> program)
+        : m_shared_program(std::move(program)) {
+        // never written through; `amend()` copies it first
+        m_data.push_back(const_cast<platter*>(m_shared_program->data()));
+        m_sizes.push_back(m_shared_program->size());
+    }
+
+    /** Use the image's mapping as array 0 directly instead of copying it.
+     */
+    explicit slab_array_store(program_image&& program)
+        : m_mapped_program(program.release()) {
+        m_data.push_back(m_mapped_program.platters);
+        m_sizes.push_back(m_mapped_program.size);
+    }
+
+    /** Use the arrays where they are in the snapshot's mapping instead of copying
+        them.
+     */
+    explicit slab_array_store(snapshot&& saved) : m_free_handles(saved.free_handles()) {
+        platter* contents = saved.contents();
+        for (std::size_t address = 0; address < saved.array_count(); ++address) {
+            platter size = saved.size(address);
+            m_data.push_back(size ? contents : nullptr);
+            m_sizes.push_back(size);
+            contents += size;
+        }
+        m_snapshot = saved.release();
+    }
+
+    slab_array_store(const slab_array_store&) = delete;
+    slab_array_store& operator=(const slab_array_store&) = delete;
+
+    slab_array_store(slab_array_store&& other)
+        : m_data(std::move(other.m_data)),
+          m_sizes(std::move(other.m_sizes)),
+          m_free_handles(std::move(other.m_free_handles)),
+          m_free_blocks(other.m_free_blocks),
+          m_mapper(other.m_mapper),
+          m_arena(other.m_arena),
+          m_arena_remaining(other.m_arena_remaining),
+          m_huge_arena(other.m_huge_arena),
+          m_huge_arena_remaining(other.m_huge_arena_remaining),
+          m_chunks(std::move(other.m_chunks)),
+          m_mapped_program(other.m_mapped_program),
+          m_snapshot(other.m_snapshot),
+          m_shared_program(std::move(other.m_shared_program)),
+          m_program_source(other.m_program_source) {
+        other.m_chunks.clear();
+        other.m_mapped_program = {};
+        other.m_snapshot = {nullptr, 0};
+    }
+
+    ~slab_array_store() {
+        for (auto [chunk, size] : m_chunks) {
+            munmap(chunk, size);
+        }
+        if (m_mapped_program.mapping) {
+            munmap(m_mapped_program.mapping, m_mapped_program.mapping_size);
+        }
+        if (m_snapshot.data) {
+            munmap(m_snapshot.data, m_snapshot.size);
+        }
+    }
+
+    /** Read access to the array at `address`; writes go through `amend()`.
+     */
+    const platter* operator[](platter address) const {
+        return m_data[address];
+    }
+
+    /** Write `value` to `index` of the array at `address`.
+
+        @return Whether array 0 had to be given its own copy, which invalidates any
+                `program()` view.
+     */
+    bool amend(platter address, platter index, platter value) {
+        bool moved = (m_program_source || m_shared_program) &&
+                     (address == 0 || address == m_program_source);
+        if (moved) {
+            unshare();
+        }
+        m_data[address][index] = value;
+        return moved;
+    }
+
+    /** The array which array 0 shares its block with, or 0 if it has been copied or
+        written to since the last `load()`.
+     */
+    platter program_source() const {
+        return m_program_source;
+    }
+
+    /** A read-only view of array 0 for the engines to fetch instructions through.
+
+        This stays valid across `abandon()` and across writes to array 0, except
+        where `amend()` says otherwise, but not across `load()`.
+     */
+    program_view program() const {
+        return m_data[0];
+    }
+
+    std::size_t size(platter address) const {
+        return m_sizes[address];
+    }
+
+    /** The number of array handles, live or free.
+     */
+    std::size_t array_count() const {
+        return m_data.size();
+    }
+
+    const std::vector<platter>& free_handles() const {
+        return m_free_handles;
+    }
+
+    const mapping_stats& memory() const {
+        return m_mapper.stats();
+    }
+
+    /** Call `f(data, count)` over the contents of the array at `address`.
+     */
+    template<typename F>
+    void read(platter address, F&& f) const {
+        f(m_data[address], m_sizes[address]);
+    }
+
+    /** Write `value` to the `count` platters of the array at `address` from
+        `index`, like `count` calls to `amend()`. The array must not be array 0 or
+        its source.
+     */
+    void fill(platter address, platter index, platter count, platter value) {
+        std::fill_n(m_data[address] + index, count, value);
+    }
+
+    /** Copy the `count` platters from `index` of the array at `source` to the same
+        place in the array at `destination`, which must not be array 0 or its
+        source.
+     */
+    void copy(platter destination, platter source, platter index, platter count) {
+        if (destination != source) {
+            std::memcpy(m_data[destination] + index,
+                        m_data[source] + index,
+                        count * sizeof(platter));
+        }
+    }
+
+    platter allocate(platter size) {
+        platter* data = new_array(size);
+        if (size) {
+            if (size_class(size) >= min_lazy_class) {
+                // fresh from the arena or from `release_block()`
+                std::memset(data, 0, sizeof(free_block));
+            }
+            else {
+                std::memset(data, 0, size * sizeof(platter));
+            }
+        }
+
+        if (m_free_handles.size()) {
+            platter address = m_free_handles.back();
+            m_free_handles.pop_back();
+            m_data[address] = data;
+            m_sizes[address] = size;
+            return address;
+        }
+
+        m_data.push_back(data);
+        m_sizes.push_back(size);
+        return m_data.size() - 1;
+    }
+
+    void abandon(platter address) {
+        if (address == m_program_source) {
+            // the block now belongs to array 0 alone
+            m_program_source = 0;
+        }
+        else {
+            release_block(m_data[address], m_sizes[address]);
+        }
+        m_data[address] = nullptr;
+        m_sizes[address] = 0;
+        m_free_handles.push_back(address);
+    }
+
+    /** Replace array 0 with the array at `address`, sharing its block until one of
+        them is amended.
+     */
+    void load(platter address) {
+        if (address == m_program_source) {
+            return;
+        }
+        if (!m_program_source) {
+            release_block(m_data[0], m_sizes[0]);
+        }
+        m_data[0] = m_data[address];
+        m_sizes[0] = m_sizes[address];
+        m_program_source = address;
+    }
+};
+
+#ifdef UM_USE_SLAB_ARRAYS
+using array_store = slab_array_store;
+#else
+using array_store = vector_array_store;
+#endif
+}  // namespace um
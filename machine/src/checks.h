@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "opcode.h"
+
+namespace um {
+/** Thrown by the checked engine when the program does something the spec leaves
+    undefined.
+ */
+class machine_fault : public std::runtime_error {
+private:
+    std::size_t m_finger;
+    platter m_instruction;
+
+    static std::string describe(std::size_t finger,
+                                platter instruction,
+                                const std::string& problem) {
+        char buffer[64];
+        std::uint8_t op = instruction >> 28;
+        std::snprintf(buffer,
+                      sizeof(buffer),
+                      "at finger %zu (0x%08x, %s): ",
+                      finger,
+                      instruction,
+                      op < opname.size() ? opname[op].c_str() : "invalid");
+        return buffer + problem;
+    }
+
+public:
+    machine_fault(std::size_t finger, platter instruction, const std::string& problem)
+        : std::runtime_error(describe(finger, instruction, problem)),
+          m_finger(finger),
+          m_instruction(instruction) {}
+
+    /** A fault with no instruction, because `finger` is outside of array 0.
+     */
+    machine_fault(std::size_t finger, const std::string& problem)
+        : std::runtime_error("at finger " + std::to_string(finger) + ": " + problem),
+          m_finger(finger),
+          m_instruction(0) {}
+
+    /** The index in array 0 of the failing instruction.
+     */
+    std::size_t finger() const {
+        return m_finger;
+    }
+
+    /** The failing instruction, or 0 if the finger was outside of array 0.
+     */
+    platter instruction() const {
+        return m_instruction;
+    }
+};
+
+/** The checking hooks for the normal engines, which trust the program. Every hook
+    is empty and every check is compiled out.
+ */
+struct no_checks {
+    static constexpr bool enabled = false;
+
+    void restore(std::size_t, const std::vector<platter>&) {}
+
+    void allocate(platter) {}
+
+    void abandon(platter) {}
+};
+
+/** What the checked engine, `--engine=checked`, needs to know to report the
+    program's mistakes instead of running into undefined behaviour: which arrays
+    are live.
+ */
+class machine_checks {
+public:
+    static constexpr bool enabled = true;
+
+private:
+    std::vector<bool> m_live;
+
+public:
+    /** Start from a store with `count` handles, all live but `free_handles`.
+     */
+    void restore(std::size_t count, const std::vector<platter>& free_handles) {
+        m_live.assign(count, true);
+        for (platter address : free_handles) {
+            m_live[address] = false;
+        }
+    }
+
+    void allocate(platter address) {
+        if (address >= m_live.size()) {
+            m_live.resize(address + 1, false);
+        }
+        m_live[address] = true;
+    }
+
+    void abandon(platter address) {
+        m_live[address] = false;
+    }
+
+    bool live(platter address) const {
+        return address < m_live.size() && m_live[address];
+    }
+};
+}  // namespace um
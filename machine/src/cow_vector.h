@@ -1,13 +1,64 @@
 #pragma once
 
-#include <vector>
+#include <algorithm>
 #include <memory>
+#include <new>
+#include <vector>
 
 namespace um {
 
-template<typename T, typename Alloc = std::allocator<T>>
+/** A vector which shares its storage with its copies until one of them is written to.
+
+    The elements are split into chunks of `chunk_size`, each with its own reference
+    count. Copying the vector only copies the table of chunk pointers, and writing
+    to a shared chunk copies just that chunk, so a one element write after a copy is
+    O(chunk_size) instead of O(n). Reads are one extra load through the chunk table.
+
+    Chunks which are grown or made with `T()` all start out as one static chunk of
+    zeros, so a large vector only costs memory for the chunks which are written.
+ */
+template<typename T, std::size_t chunk_bytes = 4096>
 class cow_vector {
+public:
+    static constexpr std::size_t chunk_size = chunk_bytes / sizeof(T);
+    static_assert(chunk_size && !(chunk_size & (chunk_size - 1)),
+                  "chunk_size must be a power of two");
+    static constexpr std::size_t chunk_shift = __builtin_ctzll(chunk_size);
+    static constexpr std::size_t chunk_mask = chunk_size - 1;
+
 private:
+    struct chunk {
+        std::size_t refcount;
+
+        T* data() {
+            return reinterpret_cast<T*>(this + 1);
+        }
+
+        const T* data() const {
+            return reinterpret_cast<const T*>(this + 1);
+        }
+    };
+    static_assert(alignof(chunk) >= alignof(T));
+
+    /** The reference count of a chunk which is never written or freed. It is
+        never touched either, and it is high enough that `unshare()` always copies
+        the chunk.
+     */
+    static constexpr std::size_t pinned = ~std::size_t(0);
+
+    /** A chunk of `T()`, which is always pinned.
+     */
+    struct zero_storage {
+        chunk header;
+        T elements[chunk_size];
+    };
+    static_assert(sizeof(zero_storage) == sizeof(chunk) + sizeof(T) * chunk_size);
+    static inline zero_storage zeros = {{pinned}, {}};
+
+    static chunk* zero_chunk() {
+        return &zeros.header;
+    }
+
     class cow_vector_subscript final {
     private:
         cow_vector& m_vector;
@@ -27,33 +78,132 @@ private:
         operator const T&() const {
             return m_vector.at(m_index);
         }
+    };
 
-        operator T&() {
-            return m_vector.at(m_index);
+    std::vector<chunk*> m_chunks;
+    std::size_t m_size = 0;
+
+    /** The number of elements in the chunk at `index`; only the last chunk may be
+        short.
+     */
+    std::size_t chunk_length(std::size_t index) const {
+        return std::min(chunk_size, m_size - (index << chunk_shift));
+    }
+
+    static chunk* new_chunk(std::size_t length) {
+        void* storage = ::operator new(sizeof(chunk) + length * sizeof(T));
+        chunk* out = static_cast<chunk*>(storage);
+        out->refcount = 1;
+        return out;
+    }
+
+    static void release(chunk* c) {
+        if (c->refcount != pinned && !--c->refcount) {
+            ::operator delete(c);
         }
-    };
+    }
+
+    void release_all() {
+        for (chunk* c : m_chunks) {
+            release(c);
+        }
+        m_chunks.clear();
+        m_size = 0;
+    }
 
-    std::shared_ptr<std::vector<T, Alloc>> m_data;
+    void share(const cow_vector& other) {
+        m_chunks = other.m_chunks;
+        m_size = other.m_size;
+        for (chunk* c : m_chunks) {
+            if (c->refcount != pinned) {
+                ++c->refcount;
+            }
+        }
+    }
 
-    void maybe_copy() {
-        if (m_data.use_count() > 1) {
-            m_data = std::make_shared<std::vector<T, Alloc>>(*m_data);
+    /** Make sure the chunk at `index` is not shared with any other vector.
+     */
+    chunk* unshare(std::size_t index) {
+        chunk* c = m_chunks[index];
+        if (__builtin_expect(c->refcount > 1, 0)) {
+            std::size_t length = chunk_length(index);
+            chunk* copy = new_chunk(length);
+            std::copy(c->data(), c->data() + length, copy->data());
+            release(c);
+            m_chunks[index] = c = copy;
         }
+        return c;
     }
 
 public:
-    cow_vector() : m_data(std::make_shared<std::vector<T, Alloc>>()) {}
+    /** A read-only view of the elements which does not keep them alive.
+
+        The view is invalidated by any write to, or resize of, the vector.
+     */
+    class view {
+    private:
+        chunk* const* m_chunks;
+
+    public:
+        view() : m_chunks(nullptr) {}
+        explicit view(chunk* const* chunks) : m_chunks(chunks) {}
+
+        const T& operator[](std::size_t index) const {
+            return m_chunks[index >> chunk_shift]->data()[index & chunk_mask];
+        }
+    };
+
+    cow_vector() = default;
+
+    cow_vector(std::size_t size, const T& value = T()) {
+        resize(size, value);
+    }
+
+    cow_vector(std::initializer_list<T> items) : cow_vector(std::vector<T>(items)) {}
+
+    explicit cow_vector(const std::vector<T>& items) : m_size(items.size()) {
+        std::size_t count = (m_size + chunk_mask) >> chunk_shift;
+        m_chunks.reserve(count);
+        for (std::size_t ix = 0; ix < count; ++ix) {
+            chunk* c = new_chunk(chunk_length(ix));
+            auto begin = items.begin() + (ix << chunk_shift);
+            std::copy(begin, begin + chunk_length(ix), c->data());
+            m_chunks.push_back(c);
+        }
+    }
+
+    cow_vector(const cow_vector& other) {
+        share(other);
+    }
+
+    cow_vector(cow_vector&& other) noexcept
+        : m_chunks(std::move(other.m_chunks)), m_size(other.m_size) {
+        other.m_chunks.clear();
+        other.m_size = 0;
+    }
 
-    cow_vector(std::initializer_list<T> items)
-        : m_data(std::make_shared<std::vector<T, Alloc>>(items)) {}
+    cow_vector& operator=(const cow_vector& other) {
+        if (this != &other) {
+            release_all();
+            share(other);
+        }
+        return *this;
+    }
 
-    cow_vector(std::size_t size, const T& value = T())
-        : m_data(std::make_shared<std::vector<T, Alloc>>(size, value)) {}
+    cow_vector& operator=(cow_vector&& other) noexcept {
+        if (this != &other) {
+            release_all();
+            m_chunks = std::move(other.m_chunks);
+            m_size = other.m_size;
+            other.m_chunks.clear();
+            other.m_size = 0;
+        }
+        return *this;
+    }
 
-    cow_vector(const cow_vector&) = default;
-    cow_vector(cow_vector&&) = default;
-    cow_vector& operator=(const cow_vector&) = default;
-    cow_vector& operator=(cow_vector&&) = default;
+    ~cow_vector() {
+        release_all();
+    }
 
     cow_vector_subscript operator[](std::size_t index) {
         return {*this, index};
@@ -65,47 +215,81 @@ public:
 
     template<typename U>
     T& assign(std::size_t index, U&& value) {
-        maybe_copy();
-        return (*m_data)[index] = std::forward<U>(value);
+        chunk* c = unshare(index >> chunk_shift);
+        return c->data()[index & chunk_mask] = std::forward<U>(value);
     }
 
-    T& at(std::size_t index) {
-        return (*m_data)[index];
+    const T& at(std::size_t index) const {
+        return m_chunks[index >> chunk_shift]->data()[index & chunk_mask];
     }
 
-    const T& at(std::size_t index) const {
-        return (*m_data)[index];
+    view read_view() const {
+        return view(m_chunks.data());
     }
 
-    auto begin() {
-        return m_data->begin();
+    /** Writable storage for the chunk holding `index`, for filling the vector in bulk.
+
+        @return The chunk's elements and how many there are.
+     */
+    std::pair<T*, std::size_t> chunk_data(std::size_t index) {
+        std::size_t chunk_index = index >> chunk_shift;
+        return {unshare(chunk_index)->data(), chunk_length(chunk_index)};
     }
 
-    auto end() {
-        return m_data->end();
+    std::pair<const T*, std::size_t> chunk_data(std::size_t index) const {
+        std::size_t chunk_index = index >> chunk_shift;
+        return {m_chunks[chunk_index]->data(), chunk_length(chunk_index)};
     }
 
-    template<typename... Args>
-    auto insert(Args&&... args) {
-        maybe_copy();
-        return m_data->insert(std::forward<Args>(args)...);
+    std::size_t size() const {
+        return m_size;
     }
 
-    void clear() {
-        if (m_data.use_count() > 1) {
-            m_data = std::make_shared<std::vector<T, Alloc>>();
-        }
-        else {
-            m_data->clear();
+    void resize(std::size_t size, const T& value = T()) {
+        std::vector<chunk*> chunks;
+        chunks.reserve((size + chunk_mask) >> chunk_shift);
+        for (std::size_t ix = 0; ix < chunks.capacity(); ++ix) {
+            if (ix >= m_chunks.size() && value == T()) {
+                chunks.push_back(zero_chunk());
+                continue;
+            }
+            std::size_t length = std::min(chunk_size, size - (ix << chunk_shift));
+            chunk* c = new_chunk(length);
+            std::size_t keep = 0;
+            if (ix < m_chunks.size()) {
+                keep = std::min(length, chunk_length(ix));
+                std::copy(m_chunks[ix]->data(), m_chunks[ix]->data() + keep, c->data());
+            }
+            std::fill(c->data() + keep, c->data() + length, value);
+            chunks.push_back(c);
         }
+        release_all();
+        m_chunks = std::move(chunks);
+        m_size = size;
+    }
+
+    void clear() {
+        release_all();
     }
 
-    const T* data() const {
-        return m_data->data();
+    /** Pin the chunks, so copies of this vector may be made, read and destroyed on
+        any thread; they only copy a chunk, to write to it. The vector must not be
+        written to while pinned, and must be unpinned once no copies are left.
+     */
+    void pin() {
+        for (chunk* c : m_chunks) {
+            if (c != zero_chunk()) {
+                c->refcount = pinned;
+            }
+        }
     }
 
-    T* data() {
-        return m_data->data();
+    void unpin() {
+        for (chunk* c : m_chunks) {
+            if (c != zero_chunk()) {
+                c->refcount = 1;
+            }
+        }
     }
 };
 }  // namespace um
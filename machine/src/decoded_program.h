@@ -0,0 +1,661 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "opcode.h"
+#include "superinstructions.h"
+
+namespace um {
+/** An instruction with its operands already pulled out of the platter.
+ */
+struct decoded_instruction {
+    /** The opcode, or `decoded_program::undecoded` if the page holding this
+        instruction has not been decoded yet.
+     */
+    std::uint8_t op;
+    std::uint8_t a;
+    std::uint8_t b;
+    std::uint8_t c;
+
+    /** The immediate for `orthography`; `a` is the register to load it into.
+     */
+    platter value;
+
+    /** Decode `p`, which is known to be an `op`.
+     */
+    template<opcode op>
+    static constexpr decoded_instruction decode(platter p) {
+        if constexpr (op == opcode::orthography) {
+            return {static_cast<std::uint8_t>(op),
+                    static_cast<std::uint8_t>(extract_bits(p, 25, 3)),
+                    0,
+                    0,
+                    extract_bits(p, 0, 25)};
+        }
+        else {
+            return {static_cast<std::uint8_t>(op),
+                    static_cast<std::uint8_t>(extract_bits(p, 6, 3)),
+                    static_cast<std::uint8_t>(extract_bits(p, 3, 3)),
+                    static_cast<std::uint8_t>(extract_bits(p, 0, 3)),
+                    0};
+        }
+    }
+
+    static constexpr decoded_instruction decode(platter p) {
+        auto op = static_cast<std::uint8_t>(extract_bits(p, 28, 4));
+        if (op == static_cast<std::uint8_t>(opcode::orthography)) {
+            return decode<opcode::orthography>(p);
+        }
+        decoded_instruction out = decode<opcode::conditional_move>(p);
+        out.op = op;
+        return out;
+    }
+};
+
+/** Whether only the last opcode of each superinstruction may leave it. The engines
+    jump and stop, as before an `input` which would block, only from the handler of
+    the opcode.
+ */
+constexpr bool superinstructions_are_straight_line() {
+    for (const superinstruction& s : superinstructions) {
+        for (std::size_t offset = 0; offset + 1 < s.length; ++offset) {
+            if (!describe(s.ops[offset]).straight_line()) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+static_assert(superinstructions_are_straight_line(),
+              "only the last opcode of a superinstruction may jump or stop");
+
+/** Maps a window of four opcodes to `first + n` where `n` is the index of the first
+    superinstruction which is a prefix of the window, or to 0 if there is none.
+ */
+constexpr std::array<std::uint8_t, 1 << 16> build_superinstruction_table(
+    std::uint8_t first) {
+    std::array<std::uint8_t, 1 << 16> table{};
+    // fill in reverse so that earlier superinstructions win
+    for (std::size_t ix = superinstructions.size(); ix--;) {
+        const superinstruction& s = superinstructions[ix];
+        std::size_t prefix = 0;
+        for (std::size_t offset = 0; offset < s.length; ++offset) {
+            prefix = (prefix << 4) | static_cast<std::size_t>(s.ops[offset]);
+        }
+        std::size_t free_bits = 4 * (4 - s.length);
+        for (std::size_t rest = 0; rest < (std::size_t(1) << free_bits); ++rest) {
+            table[(prefix << free_bits) | rest] = first + ix;
+        }
+    }
+    return table;
+}
+
+/** A loop over the platters of an array which the decoded engine runs in one go.
+
+    A bulk loop is a `do`/`while` of at most `max_length` instructions from its
+    top to a `load_program` which branches back there while a count register is
+    nonzero. Each iteration either writes a value to `d[i]` (a fill) or reads
+    `x = s[i]` and writes `d[i] = x` (a copy); then steps the index `i` by 1
+    and the count `n` by -1, either by constants or by registers which hold 1
+    and `~0` when the loop runs. The branch is the usual
+    `t = exit; u = top; if (n) t = u; load_program(0, t)`, and the loop may load
+    the constants it needs, since there are too few registers to keep them all.
+
+    `match()` checks this by following what each instruction leaves in the
+    registers in terms of their values at the top. It rejects anything else the
+    loop writes to, and anything it leaves which the next iteration wouldn't
+    see the same way, so the loop leaves every register as `run()` can.
+ */
+struct bulk_loop {
+    static constexpr std::size_t max_length = 16;
+    static constexpr std::uint8_t no_register = 8;
+
+    /** The first instruction of the loop, to run when it can't run in one go.
+     */
+    decoded_instruction first;
+    std::uint8_t length;
+    bool copy;
+    std::uint8_t destination;
+    std::uint8_t source;
+    std::uint8_t index;
+    std::uint8_t count;
+    // the register holding the value a fill writes, or `no_register` to write
+    // `fill_value`
+    std::uint8_t value;
+    platter fill_value;
+    // the registers which must hold 1 and ~0 to step the index and count, or
+    // `no_register` when they are stepped by constants
+    std::uint8_t one;
+    std::uint8_t minus_one;
+    // the register a copy leaves its last platter in, or `no_register`
+    std::uint8_t last;
+    // the registers an iteration leaves holding a constant, and the constants
+    std::uint8_t constant_registers;
+    std::array<platter, 8> constants;
+
+private:
+    /** What a register holds partway through an iteration.
+     */
+    struct symbol {
+        enum class kind : std::uint8_t {
+            // `offset` plus the values of `base` and `step` at the top
+            entry,
+            constant,
+            // the platter a copy reads
+            loaded,
+            unknown,
+        };
+
+        kind k;
+        std::uint8_t base;
+        std::uint8_t step;
+        platter offset;
+
+        static symbol constant(platter value) {
+            return {kind::constant, no_register, no_register, value};
+        }
+
+        static symbol unknown() {
+            return {kind::unknown, no_register, no_register, 0};
+        }
+
+        /** Whether this is the value `reg` had at the top.
+         */
+        bool is_entry(std::uint8_t reg) const {
+            return k == kind::entry && base == reg && step == no_register && !offset;
+        }
+
+        bool operator==(const symbol& other) const {
+            return k == other.k && base == other.base && step == other.step &&
+                   offset == other.offset;
+        }
+    };
+
+    static symbol add(const symbol& b, const symbol& c) {
+        using kind = typename symbol::kind;
+        if (b.k == kind::constant && c.k == kind::constant) {
+            return symbol::constant(b.offset + c.offset);
+        }
+        if (b.k == kind::entry && c.k == kind::constant) {
+            return {kind::entry, b.base, b.step, b.offset + c.offset};
+        }
+        if (b.k == kind::constant && c.k == kind::entry) {
+            return add(c, b);
+        }
+        if (b.k == kind::entry && b.step == no_register && c.is_entry(c.base)) {
+            return {kind::entry, b.base, c.base, b.offset};
+        }
+        if (c.k == kind::entry && c.step == no_register && b.is_entry(b.base)) {
+            return {kind::entry, c.base, b.base, c.offset};
+        }
+        return symbol::unknown();
+    }
+
+    /** Whether `s` is `reg`'s value at the top stepped by `constant`, or by a
+        register which must then hold it; if so, set `step` to that register.
+     */
+    static bool steps(symbol s, std::uint8_t reg, platter constant, std::uint8_t& step) {
+        if (s.k != symbol::kind::entry) {
+            return false;
+        }
+        if (s.base != reg && s.step == reg) {
+            std::swap(s.base, s.step);
+        }
+        if (s.base != reg || s.offset != (s.step == no_register ? constant : 0)) {
+            return false;
+        }
+        step = s.step;
+        return true;
+    }
+
+public:
+    /** Read the bulk loop at `finger` out of the decodings of it and the
+        `available - 1` instructions after it, if there is one.
+     */
+    static std::optional<bulk_loop> match(const decoded_instruction* instructions,
+                                          std::size_t available,
+                                          std::size_t finger) {
+        using kind = typename symbol::kind;
+
+        std::array<symbol, 8> registers;
+        for (std::uint8_t reg = 0; reg < 8; ++reg) {
+            registers[reg] = {kind::entry, reg, no_register, 0};
+        }
+        // the registers whose values at the top the loop reads
+        unsigned used = 0;
+        auto use = [&](std::uint8_t reg) {
+            const symbol& s = registers[reg];
+            if (s.k == kind::entry) {
+                used |= 1u << s.base;
+                if (s.step != no_register) {
+                    used |= 1u << s.step;
+                }
+            }
+            return s;
+        };
+
+        bulk_loop loop{};
+        loop.first = instructions[0];
+        loop.source = loop.value = loop.last = no_register;
+        bool amended = false;
+        std::uint8_t branch = no_register;
+        symbol test = symbol::unknown();
+        platter exit = 0;
+        for (std::size_t ix = 0; ix < std::min(available, max_length); ++ix) {
+            const decoded_instruction& i = instructions[ix];
+            auto op = static_cast<opcode>(i.op);
+            // only the zero for the `load_program` may come after the branch
+            if (branch != no_register && op != opcode::orthography &&
+                op != opcode::load_program) {
+                return std::nullopt;
+            }
+
+            switch (op) {
+            case opcode::orthography:
+                if (i.a == branch) {
+                    return std::nullopt;
+                }
+                registers[i.a] = symbol::constant(i.value);
+                break;
+            case opcode::addition: {
+                symbol b = use(i.b);
+                registers[i.a] = add(b, use(i.c));
+                break;
+            }
+            case opcode::not_and: {
+                symbol b = use(i.b);
+                symbol c = use(i.c);
+                registers[i.a] = b.k == kind::constant && c.k == kind::constant
+                                     ? symbol::constant(~(b.offset & c.offset))
+                                     : symbol::unknown();
+                break;
+            }
+            case opcode::array_index: {
+                symbol array = use(i.b);
+                symbol index = use(i.c);
+                if (loop.copy || amended || !array.is_entry(array.base) ||
+                    !index.is_entry(index.base)) {
+                    return std::nullopt;
+                }
+                loop.copy = true;
+                loop.source = array.base;
+                loop.index = index.base;
+                registers[i.a] = {kind::loaded, no_register, no_register, 0};
+                break;
+            }
+            case opcode::array_amendment: {
+                symbol array = use(i.a);
+                symbol index = use(i.b);
+                symbol value = use(i.c);
+                if (amended || !array.is_entry(array.base) ||
+                    !index.is_entry(index.base) ||
+                    (loop.copy && (index.base != loop.index || value.k != kind::loaded))) {
+                    return std::nullopt;
+                }
+                amended = true;
+                loop.destination = array.base;
+                loop.index = index.base;
+                if (loop.copy) {
+                    break;
+                }
+                if (value.k == kind::constant) {
+                    loop.fill_value = value.offset;
+                }
+                else if (value.is_entry(value.base)) {
+                    loop.value = value.base;
+                }
+                else {
+                    return std::nullopt;
+                }
+                break;
+            }
+            case opcode::conditional_move: {
+                const symbol& target = registers[i.a];
+                const symbol& top = registers[i.b];
+                test = use(i.c);
+                if (target.k != kind::constant || top.k != kind::constant ||
+                    top.offset != finger || test.k != kind::entry) {
+                    return std::nullopt;
+                }
+                // the target keeps the exit on the last iteration
+                branch = i.a;
+                exit = target.offset;
+                break;
+            }
+            case opcode::load_program: {
+                const symbol& array = registers[i.b];
+                if (branch == no_register || i.c != branch ||
+                    array.k != kind::constant || array.offset ||
+                    exit != finger + ix + 1 || !amended) {
+                    return std::nullopt;
+                }
+                loop.length = ix + 1;
+
+                // the index and count step by 1 and -1, and the count is tested
+                // after its step
+                if (!steps(registers[loop.index], loop.index, 1, loop.one) ||
+                    !steps(test, test.base == loop.index ? test.step : test.base,
+                           ~platter(0), loop.minus_one)) {
+                    return std::nullopt;
+                }
+                loop.count = test.base == loop.index ? test.step : test.base;
+                if (loop.count == loop.index || loop.count == no_register ||
+                    !(registers[loop.count] == test)) {
+                    return std::nullopt;
+                }
+                for (std::uint8_t reg : {loop.destination,
+                                         loop.source,
+                                         loop.value,
+                                         loop.one,
+                                         loop.minus_one}) {
+                    if (reg == loop.index || reg == loop.count) {
+                        return std::nullopt;
+                    }
+                }
+
+                for (std::uint8_t reg = 0; reg < 8; ++reg) {
+                    const symbol& s = registers[reg];
+                    if (reg == loop.index || reg == loop.count || s.is_entry(reg)) {
+                        continue;
+                    }
+                    // the next iteration would read something else
+                    if (used & (1u << reg)) {
+                        return std::nullopt;
+                    }
+                    if (s.k == kind::constant) {
+                        loop.constant_registers |= 1u << reg;
+                        loop.constants[reg] = s.offset;
+                    }
+                    else if (s.k == kind::loaded) {
+                        loop.last = reg;
+                    }
+                    else {
+                        return std::nullopt;
+                    }
+                }
+                return loop;
+            }
+            default:
+                return std::nullopt;
+            }
+        }
+        return std::nullopt;
+    }
+};
+
+/** A decoded copy of array 0.
+
+    Pages are decoded lazily: every instruction starts out as `undecoded`, and the
+    interpreter asks for the whole page to be decoded the first time it lands on
+    one. Only pages which have been decoded need to be touched when array 0 changes.
+
+    An instruction which starts one of the `superinstructions` is decoded with the
+    opcode `undecoded + 1 + n` where `n` is its index in the table, and one which
+    starts a `bulk_loop` with `bulk_loop_op`. Only the opcode is replaced: the
+    operands are left as they were, because a superinstruction which ends on the
+    instruction runs it from them, and the instructions covered keep their own
+    decoding so they may still be jumped to.
+ */
+class decoded_program {
+public:
+    static constexpr std::size_t page_shift = 10;
+    static constexpr std::size_t page_size = 1 << page_shift;
+
+    /** The opcode of an instruction which has not been decoded yet. This sits just
+        past the 16 values a 4 bit opcode can take.
+     */
+    static constexpr std::uint8_t undecoded = 16;
+
+    /** The opcode of the top of a `bulk_loop`, after the superinstructions. The
+        loop is found by its finger with `loop()`.
+     */
+    static constexpr std::uint8_t bulk_loop_op = undecoded + 1 + superinstructions.size();
+
+private:
+    std::vector<decoded_instruction> m_instructions;
+    std::vector<bool> m_decoded_pages;
+    // the loops decoded at each `bulk_loop_op`, by finger
+    std::unordered_map<std::size_t, bulk_loop> m_loops;
+
+#ifdef UM_TRACE_OP_CODES
+    // traces should record the real opcodes
+    static constexpr bool fuse = false;
+#else
+    static constexpr bool fuse = true;
+#endif
+    bool m_fuse = fuse;
+
+    static constexpr std::array<std::uint8_t, 1 << 16> superinstruction_table =
+        build_superinstruction_table(undecoded + 1);
+
+    /** Whether a `bulk_loop` may start with `op`, to save matching one at every
+        instruction.
+     */
+    static constexpr bool loop_may_start(std::uint8_t op) {
+        return op < opcodes.size() && describe(static_cast<opcode>(op)).straight_line() &&
+               !(describe(static_cast<opcode>(op)).effects & (manages_arrays | does_io));
+    }
+
+    /** Decode the instruction at `index`, replacing the opcode with a
+        superinstruction or `bulk_loop_op` if one starts there.
+     */
+    template<typename Program>
+    decoded_instruction decode(const Program& program, std::size_t index) {
+        decoded_instruction instruction = decoded_instruction::decode(program[index]);
+        // The instructions a superinstruction covers must be decoded too, so don't
+        // let one cross into another page. For simplicity we always look at a
+        // full window of four.
+        if (m_fuse && (index & (page_size - 1)) + 4 <= page_size &&
+            index + 4 <= m_instructions.size()) {
+            std::size_t window = 0;
+            for (std::size_t offset = 0; offset < 4; ++offset) {
+                window = (window << 4) | extract_bits(program[index + offset], 28, 4);
+            }
+            if (std::uint8_t op = superinstruction_table[window]) {
+                instruction.op = op;
+            }
+        }
+        // loops may end anywhere in the page
+        std::size_t end = std::min(((index >> page_shift) + 1) << page_shift,
+                                   m_instructions.size());
+        std::size_t available = std::min(end - index, bulk_loop::max_length);
+        if (m_fuse && loop_may_start(instruction.op) && available >= 4) {
+            std::array<decoded_instruction, bulk_loop::max_length> window;
+            for (std::size_t offset = 0; offset < available; ++offset) {
+                window[offset] = decoded_instruction::decode(program[index + offset]);
+            }
+            if (auto loop = bulk_loop::match(window.data(), available, index)) {
+                m_loops.insert_or_assign(index, *loop);
+                instruction.op = bulk_loop_op;
+                return instruction;
+            }
+        }
+        if (m_instructions[index].op == bulk_loop_op) {
+            // an amendment broke the loop which was here
+            m_loops.erase(index);
+        }
+        return instruction;
+    }
+
+public:
+    decoded_program() = default;
+
+    /** @param fuse_superinstructions Whether to decode superinstructions. Turn
+               this off to see every opcode which executes.
+     */
+    explicit decoded_program(bool fuse_superinstructions)
+        : m_fuse(fuse && fuse_superinstructions) {}
+
+    /** Forget all decoded pages; call this when array 0 is replaced.
+
+        @param size The length of the new array 0.
+     */
+    void reset(std::size_t size) {
+        for (std::size_t page = 0; page < m_decoded_pages.size(); ++page) {
+            if (m_decoded_pages[page]) {
+                auto begin = m_instructions.begin() + (page << page_shift);
+                auto end = m_instructions.begin() +
+                           std::min((page + 1) << page_shift, m_instructions.size());
+                std::fill(begin, end, decoded_instruction{undecoded, 0, 0, 0, 0});
+                m_decoded_pages[page] = false;
+            }
+        }
+        m_instructions.resize(size, {undecoded, 0, 0, 0, 0});
+        m_loops.clear();
+        m_decoded_pages.resize((size + page_size - 1) >> page_shift, false);
+    }
+
+    /** Decode the page of array 0 which contains `index`.
+
+        @param program The store's `program()` view of array 0.
+     */
+    template<typename Program>
+    void decode_page(const Program& program, std::size_t index) {
+        std::size_t page = index >> page_shift;
+        std::size_t end = std::min((page + 1) << page_shift, m_instructions.size());
+        for (std::size_t ix = page << page_shift; ix < end; ++ix) {
+            m_instructions[ix] = decode(program, ix);
+        }
+        m_decoded_pages[page] = true;
+    }
+
+    /** Update the decoded copy after `array_amendment` writes to array 0.
+
+        This re-decodes the amended instruction, and any superinstruction or bulk
+        loop which might have included it.
+     */
+    template<typename Program>
+    void amend(const Program& program, std::size_t index) {
+        std::size_t first = index < bulk_loop::max_length - 1
+                                ? 0
+                                : index - (bulk_loop::max_length - 1);
+        for (std::size_t ix = first; ix <= index; ++ix) {
+            if (m_decoded_pages[ix >> page_shift]) {
+                m_instructions[ix] = decode(program, ix);
+            }
+        }
+    }
+
+    const decoded_instruction* data() const {
+        return m_instructions.data();
+    }
+
+    /** The loop whose top, a `bulk_loop_op`, is at `index`.
+     */
+    const bulk_loop& loop(std::size_t index) const {
+        return m_loops.find(index)->second;
+    }
+};
+/** Decoded programs for the arrays `load_program` recently switched away from, so
+    switching back to one doesn't decode it again.
+
+    An entry is only valid while its array is unchanged: the machine must call
+    `invalidate()` when an array is amended or abandoned, which is cheap to skip
+    for arrays that `may_hold()` says aren't cached.
+ */
+class decoded_program_cache {
+public:
+    static constexpr std::size_t capacity = 4;
+
+private:
+    struct entry {
+        // 0 for an empty entry; array 0 is never cached
+        platter address = 0;
+        decoded_program program;
+    };
+
+    std::array<entry, capacity> m_entries;
+    std::size_t m_next = 0;
+
+    // one bit for each `address % 64` which is cached
+    std::uint64_t m_filter = 0;
+
+    static std::uint64_t filter_bit(platter address) {
+        return std::uint64_t(1) << (address & 63);
+    }
+
+    void rebuild_filter() {
+        m_filter = 0;
+        for (const entry& e : m_entries) {
+            if (e.address) {
+                m_filter |= filter_bit(e.address);
+            }
+        }
+    }
+
+public:
+    explicit decoded_program_cache(bool fuse_superinstructions) {
+        for (entry& e : m_entries) {
+            e.program = decoded_program(fuse_superinstructions);
+        }
+    }
+
+    /** Whether `address` might have an entry; false means it certainly doesn't.
+     */
+    bool may_hold(platter address) const {
+        return m_filter & filter_bit(address);
+    }
+
+    /** Keep `program`, the decoding of array `address`, and replace it with an
+        evicted entry's storage.
+     */
+    void put(platter address, decoded_program& program) {
+        entry* slot = &m_entries[m_next];
+        for (entry& e : m_entries) {
+            if (!e.address) {
+                slot = &e;
+                break;
+            }
+        }
+        if (slot == &m_entries[m_next]) {
+            m_next = (m_next + 1) % capacity;
+        }
+        std::swap(slot->program, program);
+        slot->address = address;
+        rebuild_filter();
+    }
+
+    /** Swap the cached decoding of `address` into `program`.
+
+        @return Whether there was one; if not, `program` is unchanged.
+     */
+    bool take(platter address, decoded_program& program) {
+        if (!may_hold(address)) {
+            return false;
+        }
+        for (entry& e : m_entries) {
+            if (e.address == address) {
+                std::swap(e.program, program);
+                e.address = 0;
+                rebuild_filter();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /** Drop the entry for `address`, which has been amended or abandoned.
+     */
+    void invalidate(platter address) {
+        for (entry& e : m_entries) {
+            if (e.address == address) {
+                e.address = 0;
+            }
+        }
+        rebuild_filter();
+    }
+
+    void clear() {
+        for (entry& e : m_entries) {
+            e.address = 0;
+        }
+        m_filter = 0;
+    }
+};
+}  // namespace um
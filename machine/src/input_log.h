@@ -0,0 +1,229 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include "checks.h"
+#include "io.h"
+#include "opcode.h"
+
+namespace um {
+/** The input a machine read, written by `--record` and fed back by `--replay`.
+
+    The file is a `header` and then a record for each byte an `input` produced:
+    the byte, and the difference between the finger of that `input` and of the one
+    before it, zigzag encoded as a little-endian base 128 varint. A program which
+    reads everything with one `input` costs two bytes per byte of input. The end
+    of the log is the end of the input.
+
+    A replayed log is mapped and read in place; the console's input isn't touched.
+    Every engine reads the same input at the same fingers, so an `input` at
+    another finger than the recorded one is reported as a `machine_fault`.
+ */
+class input_log {
+public:
+    static constexpr char magic[8] = {'U', 'M', '3', '2', 'I', 'N', 'P', 0};
+    static constexpr std::uint32_t version = 1;
+
+    struct header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t reserved;
+    };
+
+    enum class mode {
+        record,
+        replay,
+    };
+
+private:
+    mode m_mode;
+    std::string m_path;
+    std::size_t m_previous_finger = 0;
+    std::size_t m_bytes = 0;
+    std::FILE* m_out = nullptr;
+    void* m_mapping = nullptr;
+    std::size_t m_mapping_size = 0;
+    const unsigned char* m_next = nullptr;
+    const unsigned char* m_end = nullptr;
+
+    [[noreturn]] void fail() {
+        throw std::system_error(errno, std::generic_category(), m_path);
+    }
+
+    [[noreturn]] void malformed(const std::string& what) {
+        throw std::invalid_argument(m_path + ": " + what);
+    }
+
+    void open_recording() {
+        m_out = std::fopen(m_path.c_str(), "wb");
+        if (!m_out) {
+            fail();
+        }
+        header h = {};
+        std::memcpy(h.magic, magic, sizeof(magic));
+        h.version = version;
+        std::fwrite(&h, sizeof(h), 1, m_out);
+    }
+
+    void open_replay() {
+        int fd = ::open(m_path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            fail();
+        }
+        struct stat st;
+        if (fstat(fd, &st)) {
+            int err = errno;
+            ::close(fd);
+            throw std::system_error(err, std::generic_category(), m_path);
+        }
+        if (static_cast<std::size_t>(st.st_size) < sizeof(header)) {
+            ::close(fd);
+            malformed("too short to be an input log");
+        }
+        m_mapping_size = st.st_size;
+        m_mapping = mmap(nullptr, m_mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        int err = errno;
+        ::close(fd);
+        if (m_mapping == MAP_FAILED) {
+            m_mapping = nullptr;
+            throw std::system_error(err, std::generic_category(), m_path);
+        }
+
+        auto* bytes = static_cast<const unsigned char*>(m_mapping);
+        header h;
+        std::memcpy(&h, bytes, sizeof(h));
+        if (std::memcmp(h.magic, magic, sizeof(magic)) || h.version != version) {
+            munmap(m_mapping, m_mapping_size);
+            m_mapping = nullptr;
+            malformed("not a version " + std::to_string(version) + " input log");
+        }
+        m_next = bytes + sizeof(header);
+        m_end = bytes + m_mapping_size;
+        madvise(m_mapping, m_mapping_size, MADV_SEQUENTIAL);
+    }
+
+    platter record(machine_io& io, std::size_t finger) {
+        if (!io.input_buffered()) {
+            // the read may wait on a person for as long as they like
+            flush();
+        }
+        platter value = io.get();
+        if (value == machine_io::input_pending || value == machine_io::end_of_input) {
+            return value;
+        }
+        std::int64_t delta = std::int64_t(finger) - std::int64_t(m_previous_finger);
+        std::uint64_t zigzag = (std::uint64_t(delta) << 1) ^ std::uint64_t(delta >> 63);
+        unsigned char buffer[11] = {static_cast<unsigned char>(value)};
+        std::size_t size = 1;
+        do {
+            buffer[size++] = (zigzag & 0x7f) | (zigzag > 0x7f ? 0x80 : 0);
+            zigzag >>= 7;
+        } while (zigzag);
+        std::fwrite(buffer, 1, size, m_out);
+        m_previous_finger = finger;
+        ++m_bytes;
+        return value;
+    }
+
+    platter replay(std::size_t finger) {
+        if (m_next == m_end) {
+            return machine_io::end_of_input;
+        }
+        // most inputs are read by the same `input` as the one before
+        if (__builtin_expect(m_end - m_next >= 2 && m_next[1] == 0, 1) &&
+            finger == m_previous_finger) {
+            ++m_bytes;
+            platter value = m_next[0];
+            m_next += 2;
+            return value;
+        }
+        platter value = *m_next++;
+        std::uint64_t zigzag = 0;
+        for (int shift = 0;; shift += 7) {
+            if (m_next == m_end || shift > 63) {
+                malformed("the record of byte " + std::to_string(m_bytes) +
+                          (m_next == m_end ? " is cut short" : " is corrupt"));
+            }
+            unsigned char byte = *m_next++;
+            zigzag |= std::uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                break;
+            }
+        }
+        std::size_t recorded =
+            m_previous_finger + static_cast<std::size_t>((zigzag >> 1) ^ -(zigzag & 1));
+        if (__builtin_expect(recorded != finger, 0)) {
+            throw machine_fault(finger,
+                                "input diverged from " + m_path + ": byte " +
+                                    std::to_string(m_bytes) + " was recorded at finger " +
+                                    std::to_string(recorded));
+        }
+        m_previous_finger = finger;
+        ++m_bytes;
+        return value;
+    }
+
+public:
+    input_log(mode m, const char* path) : m_mode(m), m_path(path) {
+        if (m_mode == mode::record) {
+            open_recording();
+        }
+        else {
+            open_replay();
+        }
+    }
+
+    input_log(const input_log&) = delete;
+    input_log& operator=(const input_log&) = delete;
+
+    ~input_log() {
+        if (m_out) {
+            std::fclose(m_out);
+        }
+        if (m_mapping) {
+            munmap(m_mapping, m_mapping_size);
+        }
+    }
+
+    /** Read what the `input` at `finger` produces: the next byte of `io`, which is
+        recorded, or of the replayed log.
+     */
+    platter read(machine_io& io, std::size_t finger) {
+        if (m_mode == mode::replay) {
+            return replay(finger);
+        }
+        return record(io, finger);
+    }
+
+    /** Write out the records buffered so far.
+     */
+    void flush() {
+        if (m_out && std::fflush(m_out)) {
+            fail();
+        }
+    }
+
+    /** Call once the machine halts: flush a recording, or check that a replay read
+        the whole log.
+     */
+    void finish() {
+        flush();
+        if (m_next != m_end) {
+            throw std::invalid_argument(m_path + ": the program halted after " +
+                                        std::to_string(m_bytes) +
+                                        " bytes of the log");
+        }
+    }
+};
+}  // namespace um
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <system_error>
+
+#include "opcode.h"
+
+namespace um {
+enum class io_mode {
+    /** Flush output at every newline, for programs talking to a person.
+     */
+    line,
+
+    /** Only flush output when the buffer fills, for programs writing to a file or
+        pipe.
+     */
+    batch,
+};
+
+/** The machine's console: output and input go through buffers the machine owns,
+    and are handed to and taken from callbacks a buffer at a time. By default the
+    callbacks write and read file descriptors with raw syscalls.
+
+    Output is flushed when the buffer is full, at a newline in `io_mode::line`,
+    before asking for more input, and when the machine halts. Input is read ahead
+    as far as one call to the reader will go.
+ */
+class machine_io {
+public:
+    static constexpr std::size_t output_buffer_size = 1 << 16;
+    static constexpr std::size_t input_buffer_size = 1 << 16;
+
+    /** The value `input` produces at the end of the input.
+     */
+    static constexpr platter end_of_input = ~platter(0);
+
+    /** What `get()` returns when the reader has nothing yet. This is not a value
+        `input` can produce; the engines stop before the `input` instead.
+     */
+    static constexpr platter input_pending = 0x100;
+
+    /** What a reader returns when there is no input now but there may be later.
+     */
+    static constexpr std::ptrdiff_t would_block = -1;
+
+    /** Fill up to `capacity` bytes of `buffer`, returning how many were written, 0
+        at the end of the input, or `would_block`.
+     */
+    using reader = std::function<std::ptrdiff_t(unsigned char* buffer,
+                                                std::size_t capacity)>;
+
+    /** Consume all `size` bytes of `data`.
+     */
+    using writer = std::function<void(const unsigned char* data, std::size_t size)>;
+
+private:
+    std::size_t m_output_size = 0;
+    std::size_t m_input_begin = 0;
+    std::size_t m_input_end = 0;
+    io_mode m_mode;
+    reader m_read;
+    writer m_write;
+    std::unique_ptr<unsigned char[]> m_output;
+    std::unique_ptr<unsigned char[]> m_input;
+
+    platter refill() {
+        flush();
+        std::ptrdiff_t count = m_read(m_input.get(), input_buffer_size);
+        if (count == would_block) {
+            return input_pending;
+        }
+        if (count <= 0) {
+            return end_of_input;
+        }
+        m_input_begin = 1;
+        m_input_end = count;
+        return m_input[0];
+    }
+
+public:
+    static reader read_fd(int fd) {
+        return [fd](unsigned char* buffer, std::size_t capacity) -> std::ptrdiff_t {
+            ssize_t count;
+            do {
+                count = ::read(fd, buffer, capacity);
+            } while (count < 0 && errno == EINTR);
+            if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return would_block;
+            }
+            return count < 0 ? 0 : count;
+        };
+    }
+
+    static writer write_fd(int fd) {
+        return [fd](const unsigned char* data, std::size_t size) {
+            std::size_t written = 0;
+            while (written < size) {
+                ssize_t count = ::write(fd, data + written, size - written);
+                if (count < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::system_error(errno, std::generic_category(), "output");
+                }
+                written += count;
+            }
+        };
+    }
+
+    explicit machine_io(io_mode mode, int output_fd = 1, int input_fd = 0)
+        : machine_io(mode, read_fd(input_fd), write_fd(output_fd)) {}
+
+    machine_io(io_mode mode, reader read, writer write)
+        : m_mode(mode),
+          m_read(std::move(read)),
+          m_write(std::move(write)),
+          m_output(new unsigned char[output_buffer_size]),
+          m_input(new unsigned char[input_buffer_size]) {}
+
+    machine_io(machine_io&&) = default;
+
+    ~machine_io() {
+        if (!m_output) {
+            return;
+        }
+        try {
+            flush();
+        }
+        catch (...) {
+        }
+    }
+
+    void put(platter c) {
+        m_output[m_output_size++] = static_cast<unsigned char>(c);
+        if (__builtin_expect(m_output_size == output_buffer_size, 0) ||
+            (m_mode == io_mode::line && c == '\n')) {
+            flush();
+        }
+    }
+
+    /** Read the next input, `end_of_input`, or `input_pending`.
+     */
+    platter get() {
+        if (__builtin_expect(m_input_begin == m_input_end, 0)) {
+            return refill();
+        }
+        return m_input[m_input_begin++];
+    }
+
+    /** Whether `get()` can return without calling the reader.
+     */
+    bool input_buffered() const {
+        return m_input_begin != m_input_end;
+    }
+
+    void flush() {
+        if (m_output_size) {
+            std::size_t size = m_output_size;
+            m_output_size = 0;
+            m_write(m_output.get(), size);
+        }
+    }
+};
+}  // namespace um
@@ -0,0 +1,511 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <system_error>
+#include <vector>
+
+#include "decoded_program.h"
+#include "opcode.h"
+#include "program_analysis.h"
+
+namespace um {
+#ifdef UM_ENABLE_JIT
+#if !defined(__x86_64__)
+#error "the jit only targets x86-64; build with JIT=0"
+#endif
+
+/** A tiny x86-64 assembler for the handful of instructions the JIT emits.
+
+    Registers are named by their hardware encoding: `rax = 0` through `r15 = 15`. All
+    arithmetic is on the 32 bit views of the registers.
+ */
+class x86_emitter {
+private:
+    std::vector<std::uint8_t> m_code;
+
+    void rex(std::uint8_t reg, std::uint8_t rm) {
+        if (reg >= 8 || rm >= 8) {
+            m_code.push_back(0x40 | ((reg >> 3) << 2) | (rm >> 3));
+        }
+    }
+
+    void modrm(std::uint8_t mod, std::uint8_t reg, std::uint8_t rm) {
+        m_code.push_back((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    void reg_reg(std::initializer_list<std::uint8_t> op,
+                 std::uint8_t reg,
+                 std::uint8_t rm) {
+        rex(reg, rm);
+        m_code.insert(m_code.end(), op);
+        modrm(3, reg, rm);
+    }
+
+public:
+    static constexpr std::uint8_t rax = 0;
+    static constexpr std::uint8_t rdx = 2;
+    static constexpr std::uint8_t rdi = 7;
+
+    const std::vector<std::uint8_t>& code() const {
+        return m_code;
+    }
+
+    void clear() {
+        m_code.clear();
+    }
+
+    void mov(std::uint8_t dst, std::uint8_t src) {
+        reg_reg({0x8b}, dst, src);
+    }
+
+    void mov_imm(std::uint8_t dst, std::uint32_t value) {
+        rex(0, dst);
+        m_code.push_back(0xb8 + (dst & 7));
+        for (int shift = 0; shift < 32; shift += 8) {
+            m_code.push_back(value >> shift);
+        }
+    }
+
+    /** `mov dst, [rdi + disp]`
+     */
+    void load(std::uint8_t dst, std::int8_t disp) {
+        rex(dst, rdi);
+        m_code.push_back(0x8b);
+        modrm(1, dst, rdi);
+        m_code.push_back(disp);
+    }
+
+    /** `mov [rdi + disp], src`
+     */
+    void store(std::int8_t disp, std::uint8_t src) {
+        rex(src, rdi);
+        m_code.push_back(0x89);
+        modrm(1, src, rdi);
+        m_code.push_back(disp);
+    }
+
+    void add(std::uint8_t dst, std::uint8_t src) {
+        reg_reg({0x03}, dst, src);
+    }
+
+    void imul(std::uint8_t dst, std::uint8_t src) {
+        reg_reg({0x0f, 0xaf}, dst, src);
+    }
+
+    void and_(std::uint8_t dst, std::uint8_t src) {
+        reg_reg({0x23}, dst, src);
+    }
+
+    void xor_(std::uint8_t dst, std::uint8_t src) {
+        reg_reg({0x33}, dst, src);
+    }
+
+    void not_(std::uint8_t reg) {
+        reg_reg({0xf7}, 2, reg);
+    }
+
+    /** `div reg`: edx:eax / reg, quotient in eax.
+     */
+    void div(std::uint8_t reg) {
+        reg_reg({0xf7}, 6, reg);
+    }
+
+    void test(std::uint8_t a, std::uint8_t b) {
+        reg_reg({0x85}, b, a);
+    }
+
+    void cmovne(std::uint8_t dst, std::uint8_t src) {
+        reg_reg({0x0f, 0x45}, dst, src);
+    }
+
+    void push(std::uint8_t reg) {
+        rex(0, reg);
+        m_code.push_back(0x50 + (reg & 7));
+    }
+
+    void pop(std::uint8_t reg) {
+        rex(0, reg);
+        m_code.push_back(0x58 + (reg & 7));
+    }
+
+    void ret() {
+        m_code.push_back(0xc3);
+    }
+};
+
+/** Basic-block compiler for hot regions of array 0.
+
+    The interpreter reports every `load_program` jump target to `enter()`. Once a
+    target has been hit `threshold` times, the run of register-only instructions
+    starting there (`conditional_move`, the arithmetic ops, `not_and` and
+    `orthography`) is compiled to a native function which executes the whole run
+    with the 8 registers held in host registers. The interpreter calls the function
+    and resumes at the first instruction after the run.
+
+    The first time anything in array 0 gets hot, the array is run through
+    `analyze_program()`. If nothing in it can write to array 0, its other jump
+    targets are compiled right away: the program is spending time in this array,
+    and the blocks can't be invalidated by the array itself. Arrays which never
+    get hot, like most of the functions a program calls into briefly, are never
+    analysed.
+
+    Compiled blocks are dropped when `array_amendment` writes into the instructions
+    they were compiled from, and everything is dropped when array 0 is replaced.
+ */
+class jit {
+public:
+    using block_function = void (*)(platter* registers);
+
+    static constexpr bool enabled = true;
+
+    /** The number of times a jump target must be hit before we compile it.
+     */
+    static constexpr std::uint32_t threshold = 64;
+
+    /** Blocks shorter than this are cheaper to interpret than to call.
+     */
+    static constexpr std::size_t min_block_length = 3;
+    static constexpr std::size_t max_block_length = 256;
+
+    static constexpr std::size_t code_buffer_size = 4 << 20;
+
+    struct block {
+        block_function code;
+        std::size_t start;
+        std::size_t length;
+    };
+
+private:
+    static constexpr std::int32_t no_block = -1;
+    static constexpr std::int32_t not_compilable = -2;
+
+    struct target {
+        std::uint32_t hits = 0;
+        std::int32_t block = no_block;
+    };
+
+    // The host register for each UM register. rax and rdx are left free for
+    // `division`, and rdi holds the pointer to the machine's registers.
+    static constexpr std::uint8_t host_registers[8] = {1, 6, 8, 9, 10, 11, 3, 12};
+    static constexpr std::uint8_t rbx = 3;
+    static constexpr std::uint8_t r12 = 12;
+
+    std::uint8_t* m_code_buffer;
+    std::size_t m_code_used = 0;
+
+    std::vector<target> m_targets;
+    std::vector<std::size_t> m_touched_targets;
+    std::vector<block> m_blocks;
+    std::vector<bool> m_pages_with_code;
+    // whether anything in array 0 has got hot yet
+    bool m_analyzed = false;
+    x86_emitter m_emitter;
+
+    static bool compilable(std::uint8_t op) {
+        switch (static_cast<opcode>(op)) {
+        case opcode::conditional_move:
+        case opcode::addition:
+        case opcode::multiplication:
+        case opcode::division:
+        case opcode::not_and:
+        case opcode::orthography:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    void emit_instruction(const decoded_instruction& instruction) {
+        auto& e = m_emitter;
+        std::uint8_t a = host_registers[instruction.a];
+        std::uint8_t b = host_registers[instruction.b];
+        std::uint8_t c = host_registers[instruction.c];
+
+        switch (static_cast<opcode>(instruction.op)) {
+        case opcode::conditional_move:
+            e.test(c, c);
+            e.cmovne(a, b);
+            return;
+        case opcode::addition:
+            e.mov(x86_emitter::rax, b);
+            e.add(x86_emitter::rax, c);
+            e.mov(a, x86_emitter::rax);
+            return;
+        case opcode::multiplication:
+            e.mov(x86_emitter::rax, b);
+            e.imul(x86_emitter::rax, c);
+            e.mov(a, x86_emitter::rax);
+            return;
+        case opcode::division:
+            e.mov(x86_emitter::rax, b);
+            e.xor_(x86_emitter::rdx, x86_emitter::rdx);
+            e.div(c);
+            e.mov(a, x86_emitter::rax);
+            return;
+        case opcode::not_and:
+            e.mov(x86_emitter::rax, b);
+            e.and_(x86_emitter::rax, c);
+            e.not_(x86_emitter::rax);
+            e.mov(a, x86_emitter::rax);
+            return;
+        case opcode::orthography:
+            e.mov_imm(a, instruction.value);
+            return;
+        default:
+            __builtin_unreachable();
+        }
+    }
+
+    /** Copy `size` bytes of machine code from `source` to `code` in the code
+        buffer. Only the pages the code lands on are made writable, so the blocks
+        elsewhere in the buffer stay executable and the rest of the buffer's TLB
+        entries stay put.
+     */
+    static void write_code(std::uint8_t* code,
+                           const std::uint8_t* source,
+                           std::size_t size) {
+        static const std::uintptr_t page_size = sysconf(_SC_PAGESIZE);
+        std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(code) & ~(page_size - 1);
+        std::uintptr_t end =
+            (reinterpret_cast<std::uintptr_t>(code) + size + page_size - 1) &
+            ~(page_size - 1);
+        void* pages = reinterpret_cast<void*>(begin);
+        if (mprotect(pages, end - begin, PROT_READ | PROT_WRITE)) {
+            throw std::system_error(errno, std::generic_category(), "mprotect");
+        }
+        std::memcpy(code, source, size);
+        if (mprotect(pages, end - begin, PROT_READ | PROT_EXEC)) {
+            throw std::system_error(errno, std::generic_category(), "mprotect");
+        }
+    }
+
+    /** Compile the block starting at `start`.
+
+        @return The index of the new block in `m_blocks`, or `not_compilable`.
+     */
+    template<typename Program>
+    std::int32_t compile(const Program& program, std::size_t size, std::size_t start) {
+        std::vector<decoded_instruction> instructions;
+        std::uint8_t used = 0;
+        for (std::size_t ix = start;
+             ix < size && instructions.size() < max_block_length;
+             ++ix) {
+            auto instruction = decoded_instruction::decode(program[ix]);
+            if (!compilable(instruction.op)) {
+                break;
+            }
+            instructions.push_back(instruction);
+            used |= 1 << instruction.a;
+            if (instruction.op != static_cast<std::uint8_t>(opcode::orthography)) {
+                used |= (1 << instruction.b) | (1 << instruction.c);
+            }
+        }
+        if (instructions.size() < min_block_length) {
+            return not_compilable;
+        }
+
+        auto& e = m_emitter;
+        e.clear();
+        if (used & (1 << 6)) {
+            e.push(rbx);
+        }
+        if (used & (1 << 7)) {
+            e.push(r12);
+        }
+        for (std::uint8_t reg = 0; reg < 8; ++reg) {
+            if (used & (1 << reg)) {
+                e.load(host_registers[reg], reg * sizeof(platter));
+            }
+        }
+        for (const auto& instruction : instructions) {
+            emit_instruction(instruction);
+        }
+        for (std::uint8_t reg = 0; reg < 8; ++reg) {
+            if (used & (1 << reg)) {
+                e.store(reg * sizeof(platter), host_registers[reg]);
+            }
+        }
+        if (used & (1 << 7)) {
+            e.pop(r12);
+        }
+        if (used & (1 << 6)) {
+            e.pop(rbx);
+        }
+        e.ret();
+
+        if (m_code_used + e.code().size() > code_buffer_size) {
+            flush();
+            m_touched_targets.push_back(start);
+        }
+
+        std::uint8_t* code = m_code_buffer + m_code_used;
+        write_code(code, e.code().data(), e.code().size());
+        m_code_used += e.code().size();
+
+        std::size_t end = start + instructions.size();
+        for (std::size_t page = start >> decoded_program::page_shift;
+             page <= (end - 1) >> decoded_program::page_shift;
+             ++page) {
+            m_pages_with_code[page] = true;
+        }
+        m_blocks.push_back({reinterpret_cast<block_function>(code),
+                            start,
+                            instructions.size()});
+        return m_blocks.size() - 1;
+    }
+
+    /** Compile the blocks at `targets` now instead of waiting for them to get hot.
+        This stops once half of the code buffer is used, leaving room for the
+        blocks which do get hot.
+     */
+    template<typename Program>
+    void precompile(const Program& program, const std::vector<platter>& targets) {
+        for (platter start : targets) {
+            if (m_code_used > code_buffer_size / 2) {
+                return;
+            }
+            target& t = m_targets[start];
+            if (t.block != no_block) {
+                continue;
+            }
+            if (!t.hits) {
+                m_touched_targets.push_back(start);
+            }
+            t.block = compile(program, m_targets.size(), start);
+        }
+    }
+
+    /** Drop every compiled block and reclaim the code buffer.
+     */
+    void flush() {
+        for (std::size_t ix : m_touched_targets) {
+            m_targets[ix] = target{};
+        }
+        m_touched_targets.clear();
+        m_blocks.clear();
+        m_pages_with_code.assign(m_pages_with_code.size(), false);
+        m_code_used = 0;
+    }
+
+public:
+    jit() {
+        void* buffer = mmap(nullptr,
+                            code_buffer_size,
+                            PROT_READ | PROT_EXEC,
+                            MAP_PRIVATE | MAP_ANONYMOUS,
+                            -1,
+                            0);
+        if (buffer == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        m_code_buffer = static_cast<std::uint8_t*>(buffer);
+    }
+
+    jit(const jit&) = delete;
+    jit& operator=(const jit&) = delete;
+
+    jit(jit&& other)
+        : m_code_buffer(other.m_code_buffer),
+          m_code_used(other.m_code_used),
+          m_targets(std::move(other.m_targets)),
+          m_touched_targets(std::move(other.m_touched_targets)),
+          m_blocks(std::move(other.m_blocks)),
+          m_pages_with_code(std::move(other.m_pages_with_code)),
+          m_analyzed(other.m_analyzed) {
+        other.m_code_buffer = nullptr;
+    }
+
+    ~jit() {
+        if (m_code_buffer) {
+            munmap(m_code_buffer, code_buffer_size);
+        }
+    }
+
+    /** Drop all compiled code; call this when array 0 is replaced.
+
+        @param size The length of the new array 0.
+     */
+    void reset(std::size_t size) {
+        flush();
+        m_analyzed = false;
+        m_targets.resize(size);
+        m_pages_with_code.resize((size + decoded_program::page_size - 1) >>
+                                 decoded_program::page_shift);
+    }
+
+    /** Record a jump to `finger` and return the block compiled for it, if any.
+     */
+    template<typename Program>
+    const block* enter(const Program& program, std::size_t finger) {
+        target& t = m_targets[finger];
+        if (__builtin_expect(t.block >= 0, 1)) {
+            return &m_blocks[t.block];
+        }
+        if (t.block == not_compilable) {
+            return nullptr;
+        }
+        if (!t.hits) {
+            m_touched_targets.push_back(finger);
+        }
+        if (++t.hits < threshold) {
+            return nullptr;
+        }
+        t.block = compile(program, m_targets.size(), finger);
+        if (!m_analyzed) {
+            m_analyzed = true;
+            program_analysis analysis = analyze_program(program, m_targets.size());
+            if (analysis.code_immutable()) {
+                precompile(program, analysis.jump_targets);
+            }
+        }
+        return t.block >= 0 ? &m_blocks[t.block] : nullptr;
+    }
+
+    /** Drop any blocks compiled from the instruction at `index` after
+        `array_amendment` writes to it.
+     */
+    void amend(std::size_t index) {
+        if (!m_pages_with_code[index >> decoded_program::page_shift]) {
+            return;
+        }
+        for (block& b : m_blocks) {
+            if (b.length && b.start <= index && index < b.start + b.length) {
+                m_targets[b.start] = target{};
+                b.length = 0;
+            }
+        }
+        // The amended word might now start a block; let it be retried.
+        if (m_targets[index].block == not_compilable) {
+            m_targets[index] = target{};
+        }
+    }
+};
+#else
+struct jit {
+    using block_function = void (*)(platter* registers);
+
+    static constexpr bool enabled = false;
+
+    struct block {
+        block_function code;
+        std::size_t start;
+        std::size_t length;
+    };
+
+    void reset(std::size_t) {}
+
+    template<typename Program>
+    const block* enter(const Program&, std::size_t) {
+        return nullptr;
+    }
+
+    void amend(std::size_t) {}
+};
+#endif
+}  // namespace um
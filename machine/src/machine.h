@@ -0,0 +1,997 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "aot.h"
+#include "array_store.h"
+#include "checks.h"
+#include "decoded_program.h"
+#include "input_log.h"
+#include "io.h"
+#include "jit.h"
+#include "machine_status.h"
+#include "opcode.h"
+#include "profiler.h"
+#include "program_image.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "trace.h"
+
+namespace um {
+/** The machine.
+
+    @tparam Stats The statistics hooks: `no_stats`, or `machine_stats` to count
+            what the program does.
+    @tparam Checks `no_checks`, or `machine_checks` for the checked engine: `run()`
+            then throws a `machine_fault` for anything the spec leaves undefined.
+            The other engines never check.
+    @tparam Profiler `no_profiler`, or `machine_profiler` to sample where the
+            program spends its time.
+ */
+template<typename Stats, typename Checks = no_checks, typename Profiler = no_profiler>
+class basic_machine {
+public:
+    static constexpr bool checked = Checks::enabled;
+
+private:
+    std::array<platter, 8> m_registers;
+    array_store m_arrays;
+    std::size_t m_execution_finger;
+    decoded_program m_decoded_program;
+    decoded_program_cache m_decoded_cache;
+    jit m_jit;
+    machine_io m_io;
+    op_code_tracer m_trace_ops;
+    Stats m_stats;
+    Checks m_checks;
+    Profiler m_profiler;
+    const char* m_snapshot_path = nullptr;
+    input_log* m_input_log = nullptr;
+    machine_status m_status = machine_status::running;
+    // whether the decoded program and the JIT match array 0, so `run_decoded()`
+    // can pick up where it left off
+    bool m_decoded_current = false;
+    bool m_jit_current = false;
+    // whether array 0 has been compared with the translated image, and whether it
+    // still is that image
+    bool m_translation_checked = false;
+    bool m_translation_current = false;
+
+    // the translation runs on the machine's internals like an engine would
+    friend struct translated_program;
+
+    platter current_instruction() const {
+        return m_arrays[0][m_execution_finger];
+    }
+
+    /** Throw a `machine_fault` for the instruction being executed.
+     */
+    [[noreturn]] void fault(const std::string& problem) const {
+        std::size_t finger = m_execution_finger - 1;
+        throw machine_fault(finger, m_arrays[0][finger], problem);
+    }
+
+    void check_fetch() const {
+        if constexpr (Checks::enabled) {
+            if (m_execution_finger >= m_arrays.size(0)) {
+                throw machine_fault(m_execution_finger,
+                                    "the execution finger is past the end of array 0 "
+                                    "(size " +
+                                        std::to_string(m_arrays.size(0)) + ")");
+            }
+        }
+    }
+
+    void check_array(platter address) const {
+        if constexpr (Checks::enabled) {
+            if (!m_checks.live(address)) {
+                fault("array " + std::to_string(address) + " is not allocated");
+            }
+        }
+    }
+
+    void check_index(platter address, platter index) const {
+        if constexpr (Checks::enabled) {
+            check_array(address);
+            if (index >= m_arrays.size(address)) {
+                fault("index " + std::to_string(index) + " is out of bounds of array " +
+                      std::to_string(address) + " (size " +
+                      std::to_string(m_arrays.size(address)) + ")");
+            }
+        }
+    }
+
+    opcode read_opcode(platter p) const {
+        return static_cast<opcode>(extract_bits(p, 28, 4));
+    }
+
+    /** Run the instruction at the finger too if it is a `prediction`, the
+        predicted successor of `site`, without going back through `step()`.
+     */
+    template<opcode site, opcode prediction>
+    void predict() {
+#ifndef UM_NO_PREDICTION
+        if constexpr (Checks::enabled) {
+            // leave it to the next `step()` to report
+            if (m_execution_finger >= m_arrays.size(0)) {
+                return;
+            }
+        }
+        platter instruction = current_instruction();
+        if (__builtin_expect(read_opcode(instruction) == prediction, 1)) {
+            m_trace_ops.prediction(true);
+            m_trace_ops(static_cast<std::uint8_t>(prediction));
+            m_profiler.sample(m_arrays, m_execution_finger);
+            m_stats.prediction(site, true);
+            m_stats.op(static_cast<std::uint8_t>(prediction));
+            ++m_execution_finger;
+            run_instruction<prediction>(instruction);
+        }
+        else {
+            m_trace_ops.prediction(false);
+            m_stats.prediction(site, false);
+        }
+#endif
+    }
+
+    platter allocate_array(platter size) {
+        m_stats.allocate(size);
+        platter address = m_arrays.allocate(size);
+        m_checks.allocate(address);
+        if constexpr (Stats::enabled) {
+            m_stats.memory(m_arrays.memory());
+        }
+        return address;
+    }
+
+    void abandon_array(platter address) {
+        if constexpr (Stats::enabled) {
+            m_stats.abandon(m_arrays.size(address));
+        }
+        if (m_decoded_cache.may_hold(address)) {
+            m_decoded_cache.invalidate(address);
+        }
+        m_checks.abandon(address);
+        m_arrays.abandon(address);
+    }
+
+    /** Replace array 0 with the array at `address`.
+
+        This is kept out of line so that the `load_program` handlers, which most
+        often only jump within array 0, stay small.
+     */
+    __attribute__((noinline)) void load_array(platter address) {
+        if constexpr (Stats::enabled) {
+            m_stats.abandon(m_arrays.size(0));
+            m_stats.allocate(m_arrays.size(address));
+        }
+        m_arrays.load(address);
+        m_profiler.load();
+    }
+
+    void halt(platter) {
+        m_io.flush();
+        m_trace_ops.flush();
+        if constexpr (Stats::enabled) {
+            m_stats.memory(m_arrays.memory());
+        }
+        m_stats.dump();
+        m_profiler.dump(m_arrays);
+        m_status = machine_status::halted;
+    }
+
+    /** Write a snapshot to `m_snapshot_path` and stop.
+
+        @param finger The execution finger to resume from.
+     */
+    void checkpoint(const std::array<platter, 8>& registers, std::size_t finger) {
+        m_io.flush();
+        snapshot::write(m_snapshot_path, registers, finger, m_arrays);
+        m_status = machine_status::halted;
+    }
+
+    /** Stop before the `input` at `finger` until there is something to read.
+     */
+    void wait_for_input(const std::array<platter, 8>& registers, std::size_t finger) {
+        m_registers = registers;
+        m_execution_finger = finger;
+        m_status = machine_status::waiting_for_input;
+    }
+
+    /** Read what the `input` at `finger` produces, through `m_input_log` if there
+        is one.
+     */
+    platter read_input(std::size_t finger) {
+        if (__builtin_expect(m_input_log != nullptr, 0)) {
+            return m_input_log->read(m_io, finger);
+        }
+        return m_io.get();
+    }
+
+    void input(const decoded_instruction& i) {
+        if (__builtin_expect(m_snapshot_path != nullptr, 0)) {
+            checkpoint(m_registers, m_execution_finger - 1);
+            return;
+        }
+        platter value = read_input(m_execution_finger - 1);
+        if (__builtin_expect(value == machine_io::input_pending, 0)) {
+            wait_for_input(m_registers, m_execution_finger - 1);
+            return;
+        }
+        m_registers[i.c] = value;
+    }
+
+    /** Get ready to run with an engine which doesn't keep the decoded program up
+        to date.
+
+        @return Whether there is anything to run.
+     */
+    bool start_undecoded() {
+        m_decoded_current = m_jit_current = false;
+        if (m_status == machine_status::halted) {
+            return false;
+        }
+        m_status = machine_status::running;
+        return true;
+    }
+
+    /** Swap in the decoded program for array 0 after `load_array(address)`, keeping
+        the old one if it is the unchanged decoding of another array.
+
+        @param previous What `program_source()` was before the load.
+     */
+    void replace_decoded_program(platter previous, platter address) {
+        if (previous) {
+            m_decoded_cache.put(previous, m_decoded_program);
+        }
+        if (!m_decoded_cache.take(address, m_decoded_program)) {
+            m_decoded_program.reset(m_arrays.size(0));
+        }
+    }
+
+    /** Replace array 0 with the array at `source` for `run_decoded()`, and its
+        decoded program with the one for `source`.
+
+        @return Whether the decoded program changed, which it doesn't when array 0
+                still aliases `source`.
+     */
+    __attribute__((noinline)) bool load_decoded_array(platter source) {
+        platter previous = m_arrays.program_source();
+        load_array(source);
+        if (source == previous) {
+            return false;
+        }
+        replace_decoded_program(previous, source);
+        return true;
+    }
+
+    void load_program(const decoded_instruction& i) {
+        platter source = m_registers[i.b];
+        m_execution_finger = m_registers[i.c];
+        m_stats.load_program(source);
+        if (__builtin_expect(source != 0, 0)) {
+            load_array(source);
+        }
+    }
+
+    template<std::uint8_t operand>
+    static platter& operand_register(std::array<platter, 8>& registers,
+                                     const decoded_instruction& i) {
+        static_assert(operand == operand_a || operand == operand_b || operand == operand_c);
+        return registers[operand == operand_a ? i.a : operand == operand_b ? i.b : i.c];
+    }
+
+    /** Throw a `machine_fault` for anything `describe(op)` says the checked engine
+        checks which `i` gets wrong.
+     */
+    template<opcode op>
+    void check(const decoded_instruction& i) {
+        if constexpr (Checks::enabled) {
+            constexpr opcode_info info = describe(op);
+            if constexpr (info.nonzero != no_operand) {
+                if (!operand_register<info.nonzero>(m_registers, i)) {
+                    fault(info.zero_fault);
+                }
+            }
+            if constexpr (info.index != no_operand) {
+                check_index(operand_register<info.array>(m_registers, i),
+                            operand_register<info.index>(m_registers, i));
+            }
+            else if constexpr (info.array != no_operand) {
+                check_array(operand_register<info.array>(m_registers, i));
+            }
+            if constexpr (info.byte != no_operand) {
+                if (platter value = operand_register<info.byte>(m_registers, i);
+                    value > 255) {
+                    fault("output of " + std::to_string(value) + ", which is not a byte");
+                }
+            }
+        }
+    }
+
+    /** Run `instruction`, an `op`, for the switch engine, and then its predicted
+        successor if there is one and it is next.
+     */
+    template<opcode op>
+    void run_instruction(platter instruction) {
+        decoded_instruction i = decoded_instruction::decode<op>(instruction);
+        check<op>(i);
+        if constexpr (op == opcode::halt) {
+            halt(instruction);
+        }
+        else if constexpr (op == opcode::input) {
+            input(i);
+        }
+        else if constexpr (op == opcode::load_program) {
+            load_program(i);
+        }
+        else {
+            execute<op>(m_registers, i);
+        }
+        if constexpr (describe(op).predicted) {
+            predict<op, describe(op).successor>();
+        }
+    }
+
+    /** Run `loop` in one go, leaving the registers as it would, if it only touches
+        arrays other than array 0 and stays in bounds.
+
+        @return Whether it ran; if not, the engine runs it an iteration at a time.
+     */
+    bool run_bulk_loop(std::array<platter, 8>& registers, const bulk_loop& loop) {
+        constexpr std::uint8_t no_register = bulk_loop::no_register;
+        platter destination = registers[loop.destination];
+        platter index = registers[loop.index];
+        platter count = registers[loop.count];
+        std::size_t end = std::size_t(index) + count;
+        auto in_bounds = [&](platter address) {
+            return address < m_arrays.array_count() && end <= m_arrays.size(address);
+        };
+        if ((loop.one != no_register && registers[loop.one] != 1) ||
+            (loop.minus_one != no_register && registers[loop.minus_one] != ~platter(0)) ||
+            !count || !destination || destination == m_arrays.program_source() ||
+            !in_bounds(destination)) {
+            return false;
+        }
+        if (loop.copy) {
+            platter source = registers[loop.source];
+            if (!in_bounds(source)) {
+                return false;
+            }
+            m_arrays.copy(destination, source, index, count);
+            if (loop.last != no_register) {
+                registers[loop.last] = m_arrays[source][end - 1];
+            }
+        }
+        else {
+            m_arrays.fill(destination,
+                          index,
+                          count,
+                          loop.value != no_register ? registers[loop.value]
+                                                    : loop.fill_value);
+        }
+        if (__builtin_expect(m_decoded_cache.may_hold(destination), 0)) {
+            m_decoded_cache.invalidate(destination);
+        }
+        registers[loop.index] = end;
+        registers[loop.count] = 0;
+        for (std::uint8_t reg = 0; reg < 8; ++reg) {
+            if (loop.constant_registers & (1u << reg)) {
+                registers[reg] = loop.constants[reg];
+            }
+        }
+        return true;
+    }
+
+    /** Execute a decoded instruction which does not change the execution finger.
+
+        These are the bodies of the handlers in `run_decoded()`, shared with the
+        superinstructions. `array_amendment` here does not keep the decoded program
+        or the cache up to date, so it must not write to array 0 or a cached array.
+     */
+    template<opcode op>
+    void execute(std::array<platter, 8>& registers, const decoded_instruction& i) {
+        if constexpr (op == opcode::conditional_move) {
+            if (registers[i.c]) {
+                registers[i.a] = registers[i.b];
+            }
+        }
+        else if constexpr (op == opcode::array_index) {
+            registers[i.a] = m_arrays[registers[i.b]][registers[i.c]];
+        }
+        else if constexpr (op == opcode::array_amendment) {
+            m_arrays.amend(registers[i.a], registers[i.b], registers[i.c]);
+            m_profiler.amend(registers[i.a]);
+        }
+        else if constexpr (op == opcode::addition) {
+            registers[i.a] = registers[i.b] + registers[i.c];
+        }
+        else if constexpr (op == opcode::multiplication) {
+            registers[i.a] = registers[i.b] * registers[i.c];
+        }
+        else if constexpr (op == opcode::division) {
+            registers[i.a] = registers[i.b] / registers[i.c];
+        }
+        else if constexpr (op == opcode::not_and) {
+            registers[i.a] = ~(registers[i.b] & registers[i.c]);
+        }
+        else if constexpr (op == opcode::allocation) {
+            registers[i.b] = allocate_array(registers[i.c]);
+        }
+        else if constexpr (op == opcode::abandonment) {
+            abandon_array(registers[i.c]);
+        }
+        else if constexpr (op == opcode::output) {
+            m_io.put(registers[i.c]);
+        }
+        else if constexpr (op == opcode::orthography) {
+            registers[i.a] = i.value;
+        }
+        else {
+            static_assert(op != op, "op changes the execution finger or may stop");
+        }
+    }
+
+    /** Run `i`, an `op` in the middle of a superinstruction, unless it is an
+        `array_amendment` which must go through the normal handler: one to array 0
+        may change the instructions which follow, and one to a cached array must
+        invalidate it.
+
+        @return Whether it ran.
+     */
+    template<opcode op>
+    bool run_fused(std::array<platter, 8>& registers, const decoded_instruction& i) {
+        static_assert(describe(op).straight_line(),
+                      "only the last opcode of a superinstruction may leave it");
+        if constexpr (op == opcode::array_amendment) {
+            if (platter a = registers[i.a]; !a || m_decoded_cache.may_hold(a)) {
+                return false;
+            }
+        }
+        execute<op>(registers, i);
+        return true;
+    }
+
+    /** Run the instructions covered by superinstruction `n`, all but its last, up
+        to the first which `run_fused()` leaves to its handler.
+
+        @return How many ran.
+     */
+    template<std::size_t n, std::size_t... ixs>
+    std::size_t run_superinstruction(std::array<platter, 8>& registers,
+                                     const decoded_instruction* instruction,
+                                     std::index_sequence<ixs...>) {
+        std::size_t ran = 0;
+        ((run_fused<superinstructions[n].ops[ixs]>(registers, instruction[ixs]) &&
+          ++ran) &&
+         ...);
+        return ran;
+    }
+
+    /** Resume a snapshot with the registers and finger read out of it before its
+        arrays are moved into the store.
+     */
+    basic_machine(std::array<platter, 8> registers,
+                  std::size_t execution_finger,
+                  snapshot&& saved,
+                  machine_io io)
+        : m_registers(registers),
+          m_arrays(std::move(saved)),
+          m_execution_finger(execution_finger),
+          m_decoded_program(!Stats::enabled),
+          m_decoded_cache(!Stats::enabled),
+          m_io(std::move(io)) {
+        m_checks.restore(m_arrays.array_count(), m_arrays.free_handles());
+        if constexpr (Stats::enabled) {
+            for (std::size_t address = 0; address < m_arrays.array_count(); ++address) {
+                m_stats.allocate(m_arrays.size(address));
+            }
+            for (std::size_t ix = m_arrays.free_handles().size(); ix; --ix) {
+                m_stats.abandon(0);
+            }
+        }
+    }
+
+public:
+    basic_machine(std::vector<platter>&& program, machine_io io = machine_io(io_mode::line))
+        : m_registers({0, 0, 0, 0, 0, 0, 0, 0}),
+          m_arrays(std::move(program)),
+          m_execution_finger(0),
+          m_decoded_program(!Stats::enabled),
+          m_decoded_cache(!Stats::enabled),
+          m_io(std::move(io)) {
+        m_stats.allocate(m_arrays.size(0));
+        m_checks.restore(m_arrays.array_count(), m_arrays.free_handles());
+    }
+
+    /** Run a program shared with other machines, which is only copied if array 0 is
+        written to.
+     */
+    basic_machine(std::shared_ptr<const shared_program> program,
+                  machine_io io = machine_io(io_mode::line))
+        : m_registers({0, 0, 0, 0, 0, 0, 0, 0}),
+          m_arrays(std::move(program)),
+          m_execution_finger(0),
+          m_decoded_program(!Stats::enabled),
+          m_decoded_cache(!Stats::enabled),
+          m_io(std::move(io)) {
+        m_stats.allocate(m_arrays.size(0));
+        m_checks.restore(m_arrays.array_count(), m_arrays.free_handles());
+    }
+
+    basic_machine(program_image&& program, machine_io io = machine_io(io_mode::line))
+        : m_registers({0, 0, 0, 0, 0, 0, 0, 0}),
+          m_arrays(std::move(program)),
+          m_execution_finger(0),
+          m_decoded_program(!Stats::enabled),
+          m_decoded_cache(!Stats::enabled),
+          m_io(std::move(io)) {
+        m_stats.allocate(m_arrays.size(0));
+        m_checks.restore(m_arrays.array_count(), m_arrays.free_handles());
+    }
+
+    /** Resume a machine saved with `snapshot_at_input()`.
+     */
+    basic_machine(snapshot&& saved, machine_io io = machine_io(io_mode::line))
+        : basic_machine(saved.registers(),
+                        saved.execution_finger(),
+                        std::move(saved),
+                        std::move(io)) {}
+
+    static basic_machine parse(std::istream& stream, io_mode mode = io_mode::line) {
+        stream.seekg(0, stream.end);
+        std::size_t size = stream.tellg();
+        stream.seekg(0);
+
+        if (size % 4) {
+            throw malformed_program();
+        }
+
+        std::vector<platter> program(size / 4);
+
+        stream.read(reinterpret_cast<char*>(program.data()), size);
+
+        byteswap(program.data(), program.data(), program.size());
+        return basic_machine(std::move(program), machine_io(mode));
+    }
+
+    /** Load a program by mapping the file instead of reading it.
+     */
+    static basic_machine open(const char* path, io_mode mode = io_mode::line) {
+        return basic_machine(program_image(path), machine_io(mode));
+    }
+
+    /** Instead of executing the first `input`, save the machine to `path` and halt.
+
+        The snapshot resumes at that `input`, so a program which unpacks itself
+        before it reads anything can be restarted from after the unpacking.
+     */
+    void snapshot_at_input(const char* path) {
+        m_snapshot_path = path;
+    }
+
+    /** Record every byte `input` reads to `log`, or read them from it instead of
+        the console, as it was opened. `log` must outlive the machine's runs.
+     */
+    void log_input(input_log& log) {
+        m_input_log = &log;
+    }
+
+    void step() {
+        check_fetch();
+        platter instruction = current_instruction();
+        ++m_execution_finger;
+        opcode op = read_opcode(instruction);
+        m_trace_ops(static_cast<std::uint8_t>(op));
+        m_stats.op(static_cast<std::uint8_t>(op));
+        m_profiler.sample(m_arrays, m_execution_finger - 1);
+        if constexpr (Checks::enabled) {
+            if (static_cast<std::size_t>(op) >= opcodes.size()) {
+                fault("invalid opcode " + std::to_string(static_cast<int>(op)));
+            }
+        }
+        with_opcode(op, [&](auto op) {
+            this->template run_instruction<decltype(op)::value>(instruction);
+        });
+    }
+
+    machine_status status() const {
+        return m_status;
+    }
+
+    /** Write out any buffered output.
+     */
+    void flush() {
+        m_io.flush();
+    }
+
+    /** Whether the machine has executed `halt` or stopped to take a snapshot.
+     */
+    bool halted() const {
+        return m_status == machine_status::halted;
+    }
+
+    /** Run until the machine halts or waits for input.
+     */
+    void run() {
+        if (!start_undecoded()) {
+            return;
+        }
+        while (m_status == machine_status::running) {
+            step();
+        }
+    }
+
+    /** Run `count` steps of the switch engine, or until the machine halts or waits
+        for input. A step may run more than one instruction when a prediction hits.
+     */
+    machine_status run_for(std::size_t count) {
+        if (!start_undecoded()) {
+            return m_status;
+        }
+        for (; count && m_status == machine_status::running; --count) {
+            step();
+        }
+        return m_status;
+    }
+
+    /** Run the program with direct-threaded dispatch.
+
+        Each handler ends by fetching and decoding the next instruction and jumping
+        straight to its handler, so every opcode gets its own indirect branch instead
+        of sharing the one in `step()`. The registers, the execution finger, and the
+        base of array 0 live in locals for the duration of the loop; they are only
+        written back to the machine when we halt.
+     */
+    void run_threaded() {
+        static void* const dispatch_table[16] = {
+            &&conditional_move,
+            &&array_index,
+            &&array_amendment,
+            &&addition,
+            &&multiplication,
+            &&division,
+            &&not_and,
+            &&halt,
+            &&allocation,
+            &&abandonment,
+            &&output,
+            &&input,
+            &&load_program,
+            &&orthography,
+            &&invalid,
+            &&invalid,
+        };
+
+        if (!start_undecoded()) {
+            return;
+        }
+
+        std::array<platter, 8> registers = m_registers;
+        std::size_t finger = m_execution_finger;
+        array_store::program_view program = m_arrays.program();
+        platter instruction;
+
+#define UM_REG(ix) registers[extract_bits(instruction, 6 - ((ix) * 3), 3)]
+#define UM_DISPATCH()                                                                    \
+    instruction = program[finger++];                                                     \
+    m_trace_ops(static_cast<std::uint8_t>(instruction >> 28));                           \
+    m_stats.op(static_cast<std::uint8_t>(instruction >> 28));                            \
+    m_profiler.sample(m_arrays, finger - 1);                                             \
+    goto* dispatch_table[instruction >> 28]
+// the handler of an opcode which only needs `execute()`
+#define UM_EXECUTE(op)                                                                   \
+    op:                                                                                  \
+    execute<opcode::op>(registers, decoded_instruction::decode<opcode::op>(instruction)); \
+    UM_DISPATCH()
+
+        UM_DISPATCH();
+
+        UM_EXECUTE(conditional_move);
+        UM_EXECUTE(array_index);
+
+    array_amendment:
+        if (m_arrays.amend(UM_REG(0), UM_REG(1), UM_REG(2))) {
+            program = m_arrays.program();
+        }
+        m_profiler.amend(UM_REG(0));
+        UM_DISPATCH();
+
+        UM_EXECUTE(addition);
+        UM_EXECUTE(multiplication);
+        UM_EXECUTE(division);
+        UM_EXECUTE(not_and);
+
+    halt:
+        m_registers = registers;
+        m_execution_finger = finger;
+        halt(instruction);
+        return;
+
+        UM_EXECUTE(allocation);
+        UM_EXECUTE(abandonment);
+        UM_EXECUTE(output);
+
+    input:
+        if (__builtin_expect(m_snapshot_path != nullptr, 0)) {
+            checkpoint(registers, finger - 1);
+            return;
+        }
+        if (platter value = read_input(finger - 1);
+            __builtin_expect(value == machine_io::input_pending, 0)) {
+            wait_for_input(registers, finger - 1);
+            return;
+        }
+        else {
+            UM_REG(2) = value;
+        }
+        UM_DISPATCH();
+
+    load_program:
+        m_stats.load_program(UM_REG(1));
+        if (__builtin_expect(UM_REG(1) != 0, 0)) {
+            load_array(UM_REG(1));
+            program = m_arrays.program();
+        }
+        finger = UM_REG(2);
+        UM_DISPATCH();
+
+        UM_EXECUTE(orthography);
+
+    invalid:
+        __builtin_unreachable();
+
+#undef UM_EXECUTE
+#undef UM_DISPATCH
+#undef UM_REG
+    }
+
+    /** Run the program with direct-threaded dispatch over a decoded copy of array 0.
+
+        This is the same loop as `run_threaded()`, but instructions are read out of
+        `m_decoded_program` so the opcode and register indices are only extracted
+        once per page instead of once per executed instruction.
+
+        @tparam use_jit Count `load_program` jump targets and run the blocks that
+                `m_jit` compiles for the hot ones.
+     */
+    template<bool use_jit = false>
+    void run_decoded() {
+        static void* const dispatch_table[decoded_program::bulk_loop_op + 1] = {
+            &&conditional_move,
+            &&array_index,
+            &&array_amendment,
+            &&addition,
+            &&multiplication,
+            &&division,
+            &&not_and,
+            &&halt,
+            &&allocation,
+            &&abandonment,
+            &&output,
+            &&input,
+            &&load_program,
+            &&orthography,
+            &&invalid,
+            &&invalid,
+            &&undecoded,
+            UM_SUPERINSTRUCTION_LABELS
+            &&bulk_loop,
+        };
+
+        if (m_status == machine_status::halted) {
+            return;
+        }
+        m_status = machine_status::running;
+
+        std::array<platter, 8> registers = m_registers;
+        std::size_t finger = m_execution_finger;
+        if (!m_decoded_current) {
+            // the other engines don't keep the cache up to date
+            m_decoded_cache.clear();
+            m_decoded_program.reset(m_arrays.size(0));
+            m_decoded_current = true;
+        }
+        if constexpr (use_jit) {
+            if (!m_jit_current) {
+                m_jit.reset(m_arrays.size(0));
+                m_jit_current = true;
+            }
+        }
+        else {
+            m_jit_current = false;
+        }
+        const decoded_instruction* program = m_decoded_program.data();
+        const decoded_instruction* instruction;
+
+#define UM_DISPATCH()                                                                    \
+    instruction = &program[finger++];                                                    \
+    if (instruction->op != decoded_program::undecoded) {                                 \
+        m_trace_ops(instruction->op);                                                    \
+        m_stats.op(instruction->op);                                                     \
+        m_profiler.sample(m_arrays, finger - 1);                                         \
+    }                                                                                    \
+    goto* dispatch_table[instruction->op]
+#define UM_EXECUTE(op)                                                                   \
+    op:                                                                                  \
+    execute<opcode::op>(registers, *instruction);                                        \
+    UM_DISPATCH()
+
+        UM_DISPATCH();
+
+        UM_EXECUTE(conditional_move);
+        UM_EXECUTE(array_index);
+
+    array_amendment: {
+        // this may overwrite the instruction we are executing; read the operands first
+        platter a = registers[instruction->a];
+        platter b = registers[instruction->b];
+        m_arrays.amend(a, b, registers[instruction->c]);
+        m_profiler.amend(a);
+        if (!a) {
+            m_decoded_program.amend(m_arrays.program(), b);
+            if constexpr (use_jit) {
+                m_jit.amend(b);
+            }
+        }
+        else if (__builtin_expect(m_decoded_cache.may_hold(a), 0)) {
+            m_decoded_cache.invalidate(a);
+        }
+        UM_DISPATCH();
+    }
+
+        UM_EXECUTE(addition);
+        UM_EXECUTE(multiplication);
+        UM_EXECUTE(division);
+        UM_EXECUTE(not_and);
+
+    halt:
+        m_registers = registers;
+        m_execution_finger = finger;
+        halt(0);
+        return;
+
+        UM_EXECUTE(allocation);
+        UM_EXECUTE(abandonment);
+        UM_EXECUTE(output);
+
+    input:
+        if (__builtin_expect(m_snapshot_path != nullptr, 0)) {
+            checkpoint(registers, finger - 1);
+            return;
+        }
+        if (platter value = read_input(finger - 1);
+            __builtin_expect(value == machine_io::input_pending, 0)) {
+            wait_for_input(registers, finger - 1);
+            return;
+        }
+        else {
+            registers[instruction->c] = value;
+        }
+        UM_DISPATCH();
+
+    load_program:
+        // resetting the decoded program clobbers `instruction`, move the finger first
+        finger = registers[instruction->c];
+        m_stats.load_program(registers[instruction->b]);
+        if (platter source = registers[instruction->b];
+            __builtin_expect(source != 0, 0) && load_decoded_array(source)) {
+            program = m_decoded_program.data();
+            if constexpr (use_jit) {
+                m_jit.reset(m_arrays.size(0));
+            }
+        }
+        if constexpr (use_jit) {
+            if (const jit::block* block = m_jit.enter(m_arrays.program(), finger)) {
+                block->code(registers.data());
+                finger += block->length;
+                if constexpr (Stats::enabled) {
+                    auto program = m_arrays.program();
+                    for (std::size_t ix = block->start; ix < finger; ++ix) {
+                        m_stats.op(program[ix] >> 28);
+                    }
+                }
+            }
+        }
+        UM_DISPATCH();
+
+        UM_EXECUTE(orthography);
+
+    undecoded:
+        --finger;
+        m_decoded_program.decode_page(m_arrays.program(), finger);
+        UM_DISPATCH();
+
+    // The handler of superinstruction `n`, which jumps to the handler of its last
+    // opcode, `last`, or to `array_amendment` if `run_fused()` leaves one to it.
+#define UM_SUPERINSTRUCTION(n, last)                                                     \
+    superinstruction_##n : {                                                             \
+        constexpr std::size_t covered = superinstructions[n].length - 1;                 \
+        std::size_t ran = run_superinstruction<n>(registers,                             \
+                                                  instruction,                           \
+                                                  std::make_index_sequence<covered>{});  \
+        instruction += ran;                                                              \
+        finger += ran;                                                                   \
+        if (ran != covered) {                                                            \
+            goto array_amendment;                                                        \
+        }                                                                                \
+        goto last;                                                                       \
+    }
+
+        UM_SUPERINSTRUCTION_HANDLERS
+
+    // A `bulk_loop`, which runs one iteration at a time from its first instruction
+    // if it can't run in one go.
+    bulk_loop: {
+        const struct bulk_loop& loop = m_decoded_program.loop(finger - 1);
+        if (!run_bulk_loop(registers, loop)) {
+            instruction = &loop.first;
+            goto* dispatch_table[instruction->op];
+        }
+        finger += loop.length - 1;
+        UM_DISPATCH();
+    }
+
+    invalid:
+        __builtin_unreachable();
+
+#undef UM_SUPERINSTRUCTION
+#undef UM_EXECUTE
+#undef UM_DISPATCH
+    }
+
+    /** Run the decoded engine with hot blocks compiled to native code.
+     */
+    void run_jit() {
+        run_decoded<true>();
+    }
+
+    /** Run the program built in with `make AOT_PROGRAM=` while array 0 is the image
+        it was translated from, and then the decoded engine.
+
+        The switch engine runs each instruction the translation stops at. Once
+        that loads another array or amends array 0, array 0 is no longer the
+        image, and the decoded engine runs the rest.
+     */
+    void run_aot() {
+        if constexpr (translated_program::enabled) {
+            if (!start_undecoded()) {
+                return;
+            }
+            if (!m_translation_checked) {
+                m_translation_checked = true;
+                auto program = m_arrays.program();
+                m_translation_current = m_arrays.size(0) == translated_program::size;
+                for (std::size_t ix = 0; m_translation_current && ix < m_arrays.size(0);
+                     ++ix) {
+                    m_translation_current = program[ix] == translated_program::image[ix];
+                }
+            }
+            while (m_translation_current && m_status == machine_status::running &&
+                   m_execution_finger < translated_program::size) {
+                translated_program::run(*this, m_registers, m_execution_finger);
+                if (m_execution_finger >= translated_program::size) {
+                    break;
+                }
+                opcode op = read_opcode(current_instruction());
+                if (op == opcode::array_amendment || op == opcode::load_program) {
+                    m_translation_current = false;
+                }
+                step();
+            }
+            if (m_status != machine_status::running) {
+                return;
+            }
+        }
+        run_decoded();
+    }
+};
+
+using machine = basic_machine<no_stats>;
+}  // namespace um
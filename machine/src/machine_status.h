@@ -0,0 +1,18 @@
+#pragma once
+
+namespace um {
+enum class machine_status {
+    /** The machine may keep running.
+     */
+    running,
+
+    /** The machine executed `halt`, or stopped to take a snapshot.
+     */
+    halted,
+
+    /** The machine stopped before an `input` because its reader would block. Run
+        it again once there is input.
+     */
+    waiting_for_input,
+};
+}  // namespace um
@@ -1,351 +1,540 @@
-#include <array>
-#include <cstdint>
-#include <cstdio>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
-#include <tuple>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
 #include <vector>
 
-#include "cow_vector.h"
-
-namespace um {
-#ifdef UM_USE_COW_VECTOR
-template<typename T>
-using array_vector = cow_vector<T>;
-#else
-template<typename T>
-using array_vector = std::vector<T>;
+#include "aot.h"
+#include "checks.h"
+#include "input_log.h"
+#include "io.h"
+#include "jit.h"
+#include "machine.h"
+#include "opcode.h"
+#include "program_analysis.h"
+#include "program_image.h"
+#include "session_scheduler.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "work_stealing_pool.h"
+
+#ifdef UM_AOT_PROGRAM
+#include UM_AOT_PROGRAM
 #endif
 
-using platter = uint32_t;
-
-enum class opcode : uint8_t {
-    conditional_move = 0,
-    array_index = 1,
-    array_amendment = 2,
-    addition = 3,
-    multiplication = 4,
-    division = 5,
-    not_and = 6,
-    halt = 7,
-    allocation = 8,
-    abandonment = 9,
-    output = 10,
-    input = 11,
-    load_program = 12,
-    orthography = 13,
-};
-
-std::array<std::string, 14> opname = {
-    "conditional_move",
-    "array_index",
-    "array_amendment",
-    "addition",
-    "multiplication",
-    "division",
-    "not_and",
-    "halt",
-    "allocation",
-    "abandonment",
-    "output",
-    "input",
-    "load_program",
-    "orthography",
-};
-
-platter extract_bits(platter p, uint8_t start, uint8_t count) {
-    platter mask = ((1 << count) - 1) << start;
-    return (p & mask) >> start;
+namespace {
+int usage(const char* argv0) {
+    std::cerr << "usage: " << argv0 << " [OPTIONS] PROGRAM\n"
+              << "       " << argv0 << " [OPTIONS] --restore=SNAPSHOT\n"
+              << "       " << argv0 << " [OPTIONS] --batch=MANIFEST [--jobs=N]\n"
+              << "       " << argv0
+              << " [OPTIONS] --serve=PORT [--jobs=N] {PROGRAM | --restore=SNAPSHOT}\n"
+              << "\n"
+              << "  --engine={switch,threaded,decoded" << (um::jit::enabled ? ",jit" : "")
+              << ",checked" << (um::translated_program::enabled ? ",aot" : "") << "}\n"
+              << "                      checked is the switch engine, stopping with an\n"
+              << "                      error at anything the spec leaves undefined\n"
+              << "  --io={line,batch}   flush output at each newline, or only when the\n"
+              << "                      buffer fills (default: line if stdout is a tty)\n"
+              << "  --save-native=PATH  write PROGRAM in native byte order to PATH\n"
+              << "  --analyze           describe PROGRAM's blocks, jumps and writes to\n"
+              << "                      array 0 instead of running it\n"
+              << "  --translate=PATH    write PROGRAM as C++ to PATH instead of running\n"
+              << "                      it, to build in with make AOT_PROGRAM=PATH\n"
+              << "  --snapshot=PATH     save the machine to PATH at the first input,\n"
+              << "                      instead of running it, and exit\n"
+              << "  --restore=PATH      resume a machine saved with --snapshot\n"
+              << "  --record=PATH       log every byte input reads, and where, to PATH\n"
+              << "  --replay=PATH       read the input logged with --record from PATH\n"
+              << "                      instead of stdin, stopping with an error if it\n"
+              << "                      is read anywhere else\n"
+              << "  --stats             count opcodes, predictions, and arrays and\n"
+              << "                      print them at halt or on SIGUSR1; also set by\n"
+              << "                      UM_STATS=1\n"
+              << "  --profile=PATH      sample the finger every millisecond of CPU time\n"
+              << "                      and write the counts to PATH at halt, for\n"
+              << "                      etc/profile-report\n"
+              << "  --batch=MANIFEST    run every job in MANIFEST, one line each of\n"
+              << "                      'IMAGE STDIN STDOUT' ('-' for /dev/null)\n"
+              << "  --serve=PORT        run a machine for each connection to PORT on\n"
+              << "                      localhost, with the socket as its console\n"
+              << "  --jobs=N            run N batch jobs at once, or serve on N threads\n"
+              << "                      (default: one per core)\n";
+    if (um::array_store::maps_memory) {
+        std::cerr
+            << "  --huge-pages={off,transparent,explicit}\n"
+            << "                      back large arrays with 2 MiB pages: madvise for\n"
+            << "                      transparent huge pages, or MAP_HUGETLB from the\n"
+            << "                      reserved pool (default: off)\n"
+            << "  --huge-page-threshold=BYTES\n"
+            << "                      the smallest array to put on huge pages\n"
+            << "                      (default: 2097152)\n"
+            << "  --numa              bind each machine's arrays to the NUMA node of\n"
+            << "                      the thread which made it\n";
+    }
+    return -1;
 }
 
-struct malformed_program : public std::invalid_argument {
-public:
-    malformed_program() : std::invalid_argument("malformed_program") {}
+/** The hooks to compile a machine with, picked at runtime.
+ */
+template<typename Stats, typename Checks>
+struct hooks {
+    using stats = Stats;
+    using checks = Checks;
 };
 
-#if defined(UM_TRACE_OP_CODES)
-#define STR2(x) #x
-#define STR(x) STR2(x)
-
-class op_code_tracer {
-private:
-    std::fstream m_out;
-    std::size_t m_predictions = 0;
-    std::size_t m_mispredictions = 0;
-
-public:
-    op_code_tracer() : m_out(STR(UM_TRACE_OP_CODES), m_out.out | m_out.binary) {}
-
-    void operator()(std::uint8_t op) {
-        m_out << op;
-    }
-
-    void prediction(bool b) {
-        if (b) {
-            m_predictions += 1;
-        }
-        else {
-            m_mispredictions += 1;
+/** Call `f(hooks<Stats, Checks>())` for the hooks `--stats` and `--engine` ask for.
+ */
+template<typename F>
+auto with_hooks(bool stats, bool checked, F&& f) {
+    if (stats) {
+        if (checked) {
+            return f(hooks<um::machine_stats, um::machine_checks>());
         }
+        return f(hooks<um::machine_stats, um::no_checks>());
     }
-
-    void flush() {
-        std::cerr << "\n\n====   predicted: " << m_predictions
-                  << "\n====mispredicted: " << m_mispredictions << "\n====           %: "
-                  << static_cast<double>(m_predictions) /
-                         (m_predictions + m_mispredictions)
-                  << '\n';
-        m_out.flush();
+    if (checked) {
+        return f(hooks<um::no_stats, um::machine_checks>());
     }
-};
-#undef STR
-#undef STR2
-#else
-struct op_code_tracer {
-    void operator()(std::uint8_t) {}
-
-    void prediction(bool) {}
-
-    void flush() {}
-};
-#endif
+    return f(hooks<um::no_stats, um::no_checks>());
+}
 
-class machine {
-private:
-    std::array<platter, 8> m_registers;
-    std::vector<platter> m_free_list;
-    std::vector<array_vector<platter>> m_arrays;
-    std::size_t m_execution_finger;
-    op_code_tracer m_trace_ops;
+/** Print what `analyze_program()` finds in `image`.
+ */
+void print_analysis(const um::program_image& image) {
+    std::vector<um::platter> program(image.size());
+    image.copy_to(program.data());
+    um::program_analysis analysis = um::analyze_program(program, program.size());
+    std::cout << "instructions    " << program.size() << '\n'
+              << "blocks          " << analysis.blocks << '\n'
+              << "jump targets    " << analysis.jump_targets.size() << '\n'
+              << "static jumps    " << analysis.static_jumps << '\n'
+              << "far jumps       " << analysis.far_jumps << '\n'
+              << "dynamic jumps   " << analysis.dynamic_jumps << '\n'
+              << "amendments      " << analysis.amendments << '\n'
+              << "  of array 0?   " << analysis.code_amendments << '\n'
+              << "code immutable  " << (analysis.code_immutable() ? "yes" : "no") << '\n';
+}
 
-    platter current_instruction() const {
-        return m_arrays[0][m_execution_finger];
+template<typename Machine>
+void run_engine(Machine& m, std::string_view engine) {
+    if constexpr (Machine::checked) {
+        // only the switch engine checks anything
+        m.run();
     }
-
-    opcode read_opcode(platter p) const {
-        return static_cast<opcode>(extract_bits(p, 28, 4));
+    else if (engine == "threaded") {
+        m.run_threaded();
     }
-
-    template<std::size_t... ixs>
-    auto read_registers(platter p) {
-        return std::tie(m_registers[extract_bits(p, 6 - (ixs * 3), 3)]...);
+    else if (engine == "decoded") {
+        m.run_decoded();
     }
-
-    template<opcode prediction, typename F>
-    void predict([[maybe_unused]] F&& f) {
-#ifndef UM_NO_PREDICTION
-        platter instruction = current_instruction();
-        if (__builtin_expect(read_opcode(instruction) == prediction, 1)) {
-            m_trace_ops.prediction(true);
-            ++m_execution_finger;
-            f(instruction);
-        }
-        else {
-            m_trace_ops.prediction(false);
-        }
-#endif
+    else if (engine == "jit") {
+        m.run_jit();
     }
-
-    void conditional_move(platter instruction) {
-        auto [a, b, c] = read_registers<0, 1, 2>(instruction);
-        if (c) {
-            a = b;
-        }
-
-        predict<opcode::load_program>([&](auto instr) { load_program(instr); });
+    else if (engine == "aot") {
+        m.run_aot();
     }
-
-    void array_index(platter instruction) {
-        auto [a, b, c] = read_registers<0, 1, 2>(instruction);
-        a = m_arrays[b][c];
+    else {
+        m.run();
     }
+}
 
-    void array_amendment(platter instruction) {
-        auto [a, b, c] = read_registers<0, 1, 2>(instruction);
-        m_arrays[a][b] = c;
-
-        predict<opcode::orthography>([&](auto instr) { orthography(instr); });
+template<typename Stats,
+         typename Checks,
+         typename Profiler = um::no_profiler,
+         typename Source>
+void run(Source&& source,
+         um::io_mode io,
+         std::string_view engine,
+         const char* snapshot_path,
+         um::input_log* log) {
+    um::basic_machine<Stats, Checks, Profiler> m(std::move(source), um::machine_io(io));
+    if (snapshot_path) {
+        m.snapshot_at_input(snapshot_path);
     }
-
-    void addition(platter instruction) {
-        auto [a, b, c] = read_registers<0, 1, 2>(instruction);
-        a = b + c;
+    if (log) {
+        m.log_input(*log);
     }
-
-    void multiplication(platter instruction) {
-        auto [a, b, c] = read_registers<0, 1, 2>(instruction);
-        a = b * c;
+    run_engine(m, engine);
+    if (log) {
+        m.flush();
+        log->finish();
     }
+}
 
-    void division(platter instruction) {
-        auto [a, b, c] = read_registers<0, 1, 2>(instruction);
-        a = b / c;
-    }
+struct batch_job {
+    std::string image;
+    std::string input;
+    std::string output;
+    std::shared_ptr<const um::shared_program> program;
+    std::string error;
+};
 
-    void not_and(platter instruction) {
-        auto [a, b, c] = read_registers<0, 1, 2>(instruction);
-        a = ~(b & c);
+/** Closes a file descriptor when it goes out of scope.
+ */
+struct scoped_fd {
+    int fd;
+
+    ~scoped_fd() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
     }
+};
 
-    void halt(platter) {
-        m_trace_ops.flush();
-        std::exit(0);
+int open_job_file(const std::string& path, int flags) {
+    int fd = ::open(path == "-" ? "/dev/null" : path.c_str(), flags, 0644);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), path);
     }
+    return fd;
+}
 
-    void allocation(platter instruction) {
-        auto [b, c] = read_registers<1, 2>(instruction);
-        if (m_free_list.size()) {
-            platter address = m_free_list.back();
-            m_free_list.pop_back();
+/** Run each job in `manifest` in its own machine, `threads` at a time.
 
-            auto& vec = m_arrays[address];
-            vec.insert(vec.end(), c, 0);
+    Every image is loaded and converted to native byte order once, and the jobs
+    which run it use it as their array 0, copying it only if they write to it.
 
-            b = address;
+    @return The number of jobs which failed.
+ */
+template<typename Stats, typename Checks>
+std::size_t run_batch(const char* manifest, std::string_view engine, std::size_t threads) {
+    std::ifstream in(manifest);
+    if (!in) {
+        throw std::system_error(errno, std::generic_category(), manifest);
+    }
+    std::vector<batch_job> jobs;
+    std::map<std::string, std::shared_ptr<const um::shared_program>> images;
+    std::string line;
+    for (std::size_t line_number = 1; std::getline(in, line); ++line_number) {
+        std::istringstream fields(line);
+        batch_job job;
+        if (!(fields >> job.image) || job.image[0] == '#') {
+            continue;
         }
-        else {
-            m_arrays.emplace_back(c, 0);
-            b = m_arrays.size() - 1;
+        if (!(fields >> job.input >> job.output)) {
+            throw std::invalid_argument(std::string(manifest) + ":" +
+                                        std::to_string(line_number) +
+                                        ": expected IMAGE STDIN STDOUT");
         }
-
-        predict<opcode::orthography>([&](auto instr) { orthography(instr); });
+        auto& program = images[job.image];
+        if (!program) {
+            um::program_image image(job.image.c_str());
+            std::vector<um::platter> platters(image.size());
+            image.copy_to(platters.data());
+            program = std::make_shared<um::shared_program>(std::move(platters));
+        }
+        job.program = program;
+        jobs.push_back(std::move(job));
     }
 
-    void abandonment(platter instruction) {
-        auto [c] = read_registers<2>(instruction);
-        m_arrays[c].clear();
-        m_free_list.push_back(c);
+    std::atomic<std::size_t> failures = 0;
+    um::work_stealing_for(jobs.size(), threads, [&](std::size_t index) {
+        batch_job& job = jobs[index];
+        try {
+            scoped_fd input{open_job_file(job.input, O_RDONLY)};
+            scoped_fd output{
+                open_job_file(job.output, O_WRONLY | O_CREAT | O_TRUNC)};
+            um::basic_machine<Stats, Checks> m(job.program,
+                                               um::machine_io(um::io_mode::batch,
+                                                              output.fd,
+                                                              input.fd));
+            run_engine(m, engine);
+        }
+        catch (const std::exception& e) {
+            job.error = e.what();
+            ++failures;
+        }
+    });
 
-        predict<opcode::conditional_move>([&](auto instr) { conditional_move(instr); });
+    for (const batch_job& job : jobs) {
+        if (!job.error.empty()) {
+            std::cerr << job.image << " < " << job.input << " > " << job.output << ": "
+                      << job.error << '\n';
+        }
     }
+    return failures;
+}
 
-    void output(platter instruction) {
-        auto [c] = read_registers<2>(instruction);
-        std::putchar(c);
-
-        predict<opcode::orthography>([&](auto instr) { orthography(instr); });
+/** Accept connections on `port` on the loopback interface forever, and run a
+    machine made by `make` for each one on `threads` threads.
+ */
+template<typename Stats, typename Checks, typename Make>
+[[noreturn]] void serve(std::uint16_t port,
+                        Make make,
+                        um::io_mode io,
+                        std::string_view engine,
+                        std::size_t threads) {
+    using machine_type = um::basic_machine<Stats, Checks>;
+    um::session_scheduler<machine_type> scheduler(
+        threads,
+        [make](um::machine_io io) {
+            return std::make_unique<machine_type>(make(), std::move(io));
+        },
+        [engine](machine_type& m) { run_engine(m, engine); },
+        io);
+
+    scoped_fd listener{::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+    if (listener.fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "socket");
     }
-
-    void input(platter instruction) {
-        auto [c] = read_registers<2>(instruction);
-        c = std::getchar();
+    int reuse = 1;
+    ::setsockopt(listener.fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::bind(listener.fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+        ::listen(listener.fd, SOMAXCONN) < 0) {
+        throw std::system_error(errno, std::generic_category(), "listen");
     }
-
-    void load_program(platter instruction) {
-        auto [b, c] = read_registers<1, 2>(instruction);
-        m_execution_finger = c;
-        if (b) {
-            m_arrays[0] = m_arrays[b];
+    while (true) {
+        int fd = ::accept4(listener.fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "accept");
         }
+        scheduler.add(fd);
     }
+}
+}  // namespace
 
-    void orthography(platter instruction) {
-        std::uint8_t a_index = extract_bits(instruction, 25, 3);
-        platter value = extract_bits(instruction, 0, 25);
-
-        m_registers[a_index] = value;
-    }
-
-public:
-    machine(array_vector<platter>&& program)
-        : m_registers({0, 0, 0, 0, 0, 0, 0, 0}),
-          m_arrays({std::move(program)}),
-          m_execution_finger(0) {}
-
-    static machine parse(std::istream& stream) {
-        stream.seekg(0, stream.end);
-        std::size_t size = stream.tellg();
-        stream.seekg(0);
-
-        if (size % 4) {
-            throw malformed_program();
+int main(int argc, char** argv) {
+    std::string_view engine = "switch";
+    um::io_mode io = isatty(1) ? um::io_mode::line : um::io_mode::batch;
+    const char* save_native = nullptr;
+    bool analyze = false;
+    const char* translate_path = nullptr;
+    const char* stats_env = std::getenv("UM_STATS");
+    bool stats = stats_env && *stats_env && std::string_view(stats_env) != "0";
+    const char* profile_path = nullptr;
+    const char* snapshot_path = nullptr;
+    const char* restore_path = nullptr;
+    const char* record_path = nullptr;
+    const char* replay_path = nullptr;
+    const char* batch_path = nullptr;
+    std::uint16_t serve_port = 0;
+    std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    um::mapping_options memory;
+    const char* path = nullptr;
+    for (int ix = 1; ix < argc; ++ix) {
+        std::string_view arg = argv[ix];
+        if (arg.substr(0, 9) == "--engine=") {
+            engine = arg.substr(9);
         }
-
-        array_vector<platter> program(size / 4);
-
-        stream.read(reinterpret_cast<char*>(program.data()), size);
-
-        for (platter& p : program) {
-            p = __builtin_bswap32(p);
+        else if (arg.substr(0, 5) == "--io=") {
+            if (arg.substr(5) == "line") {
+                io = um::io_mode::line;
+            }
+            else if (arg.substr(5) == "batch") {
+                io = um::io_mode::batch;
+            }
+            else {
+                return usage(argv[0]);
+            }
         }
-        return machine(std::move(program));
-    }
-
-    void step() {
-        platter instruction = current_instruction();
-        ++m_execution_finger;
-        opcode op = read_opcode(instruction);
-        m_trace_ops(static_cast<std::uint8_t>(op));
-        switch (op) {
-        case opcode::conditional_move:
-            conditional_move(instruction);
-            return;
-        case opcode::array_index:
-            array_index(instruction);
-            return;
-        case opcode::array_amendment:
-            array_amendment(instruction);
-            return;
-        case opcode::addition:
-            addition(instruction);
-            return;
-        case opcode::multiplication:
-            multiplication(instruction);
-            return;
-        case opcode::division:
-            division(instruction);
-            return;
-        case opcode::not_and:
-            not_and(instruction);
-            return;
-        case opcode::halt:
-            halt(instruction);
-            return;
-        case opcode::allocation:
-            allocation(instruction);
-            return;
-        case opcode::abandonment:
-            abandonment(instruction);
-            return;
-        case opcode::output:
-            output(instruction);
-            return;
-        case opcode::input:
-            input(instruction);
-            return;
-        case opcode::load_program:
-            load_program(instruction);
-            return;
-        case opcode::orthography:
-            orthography(instruction);
-            return;
-        default:
-            __builtin_unreachable();
+        else if (arg == "--stats") {
+            stats = true;
         }
-    }
-
-    void run() {
-        while (true) {
-            step();
+        else if (arg.substr(0, 10) == "--profile=") {
+            profile_path = argv[ix] + 10;
+        }
+        else if (arg == "--analyze") {
+            analyze = true;
+        }
+        else if (arg.substr(0, 12) == "--translate=") {
+            translate_path = argv[ix] + 12;
+        }
+        else if (arg.substr(0, 14) == "--save-native=") {
+            save_native = argv[ix] + 14;
+        }
+        else if (arg.substr(0, 11) == "--snapshot=") {
+            snapshot_path = argv[ix] + 11;
+        }
+        else if (arg.substr(0, 10) == "--restore=") {
+            restore_path = argv[ix] + 10;
+        }
+        else if (arg.substr(0, 9) == "--record=") {
+            record_path = argv[ix] + 9;
+        }
+        else if (arg.substr(0, 9) == "--replay=") {
+            replay_path = argv[ix] + 9;
+        }
+        else if (arg.substr(0, 8) == "--batch=") {
+            batch_path = argv[ix] + 8;
+        }
+        else if (arg.substr(0, 8) == "--serve=") {
+            unsigned long port = std::strtoul(argv[ix] + 8, nullptr, 10);
+            if (!port || port > 0xffff) {
+                return usage(argv[0]);
+            }
+            serve_port = port;
+        }
+        else if (um::array_store::maps_memory && arg.substr(0, 13) == "--huge-pages=") {
+            using huge_pages = um::mapping_options::huge_pages;
+            if (arg.substr(13) == "off") {
+                memory.pages = huge_pages::off;
+            }
+            else if (arg.substr(13) == "transparent") {
+                memory.pages = huge_pages::transparent;
+            }
+            else if (arg.substr(13) == "explicit") {
+                memory.pages = huge_pages::explicit_pool;
+            }
+            else {
+                return usage(argv[0]);
+            }
+        }
+        else if (um::array_store::maps_memory &&
+                 arg.substr(0, 22) == "--huge-page-threshold=") {
+            char* end;
+            memory.huge_page_threshold = std::strtoull(argv[ix] + 22, &end, 10);
+            if (end == argv[ix] + 22 || *end) {
+                return usage(argv[0]);
+            }
+        }
+        else if (um::array_store::maps_memory && arg == "--numa") {
+            memory.numa = true;
+        }
+        else if (arg.substr(0, 7) == "--jobs=") {
+            threads = std::strtoul(argv[ix] + 7, nullptr, 10);
+            if (!threads) {
+                return usage(argv[0]);
+            }
+        }
+        else if (path) {
+            return usage(argv[0]);
+        }
+        else {
+            path = argv[ix];
         }
     }
-};
-}  // namespace um
-
-int main(int argc, char** argv) {
-    if (argc != 2) {
-        std::cerr << "usage: " << argv[0] << " PROGRAM\n";
-        return -1;
+    if (!path + !restore_path + !batch_path != 2 ||
+        ((restore_path || batch_path) && save_native) || (batch_path && snapshot_path) ||
+        ((analyze || translate_path) && (!path || serve_port || snapshot_path)) ||
+        (serve_port && (batch_path || snapshot_path)) ||
+        ((record_path || replay_path) &&
+         ((record_path && replay_path) || batch_path || serve_port || snapshot_path ||
+          analyze || translate_path)) ||
+        (profile_path && (stats || engine == "checked" || batch_path || serve_port ||
+                          snapshot_path || analyze || translate_path)) ||
+        (engine != "switch" && engine != "threaded" && engine != "decoded" &&
+         engine != "checked" && !(um::jit::enabled && engine == "jit") &&
+         !(um::translated_program::enabled && engine == "aot"))) {
+        return usage(argv[0]);
     }
 
-    std::fstream stream(argv[1], stream.binary | stream.in);
+    um::array_store::options = memory;
 
     try {
-        um::machine::parse(stream).run();
+        bool checked = engine == "checked";
+        std::unique_ptr<um::input_log> log;
+        auto start = [&](auto&& source) {
+            if (record_path) {
+                log = std::make_unique<um::input_log>(um::input_log::mode::record,
+                                                      record_path);
+            }
+            else if (replay_path) {
+                log = std::make_unique<um::input_log>(um::input_log::mode::replay,
+                                                      replay_path);
+            }
+            if (profile_path) {
+                um::machine_profiler::path = profile_path;
+                run<um::no_stats, um::no_checks, um::machine_profiler>(
+                    std::move(source), io, engine, snapshot_path, log.get());
+                return;
+            }
+            with_hooks(stats, checked, [&](auto h) {
+                using h_type = decltype(h);
+                run<typename h_type::stats, typename h_type::checks>(
+                    std::move(source), io, engine, snapshot_path, log.get());
+            });
+        };
+
+        if (batch_path) {
+            std::size_t failures = with_hooks(stats, checked, [&](auto h) {
+                using h_type = decltype(h);
+                return run_batch<typename h_type::stats, typename h_type::checks>(
+                    batch_path, engine, threads);
+            });
+            return failures ? 1 : 0;
+        }
+        if (serve_port) {
+            auto start_serving = [&](auto make) {
+                with_hooks(stats, checked, [&](auto h) {
+                    using h_type = decltype(h);
+                    serve<typename h_type::stats, typename h_type::checks>(
+                        serve_port, make, io, engine, threads);
+                });
+            };
+            if (restore_path) {
+                start_serving([restore_path] { return um::snapshot(restore_path); });
+            }
+            else {
+                start_serving([path] { return um::program_image(path); });
+            }
+        }
+        if (restore_path) {
+            start(um::snapshot(restore_path));
+        }
+        else {
+            um::program_image image(path);
+            if (save_native) {
+                image.write_native(save_native);
+            }
+            if (analyze) {
+                print_analysis(image);
+                return 0;
+            }
+            if (translate_path) {
+                std::vector<um::platter> program(image.size());
+                image.copy_to(program.data());
+                std::ofstream out(translate_path);
+                um::translate_program(program, program.size(), out);
+                if (!out) {
+                    throw std::system_error(errno, std::generic_category(), translate_path);
+                }
+                return 0;
+            }
+            start(std::move(image));
+        }
+    }
+    catch (const um::machine_fault& e) {
+        std::cerr << e.what() << '\n';
+        return -1;
     }
     catch (const um::malformed_program& e) {
         std::cerr << e.what() << '\n';
         return -1;
     }
+    catch (const std::system_error& e) {
+        std::cerr << e.what() << '\n';
+        return -1;
+    }
+    catch (const std::invalid_argument& e) {
+        std::cerr << e.what() << '\n';
+        return -1;
+    }
+    catch (const std::runtime_error& e) {
+        std::cerr << e.what() << '\n';
+        return -1;
+    }
     return 0;
 }
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+namespace um {
+/** How to back the large arrays of a store which maps its own memory.
+ */
+struct mapping_options {
+    enum class huge_pages {
+        // ordinary pages
+        off,
+        // `madvise(MADV_HUGEPAGE)`, for the kernel to use transparent huge pages
+        transparent,
+        // `MAP_HUGETLB` from the reserved pool, or transparent if it is empty
+        explicit_pool,
+    };
+
+    static constexpr std::size_t huge_page_size = 2 << 20;
+
+    huge_pages pages = huge_pages::off;
+
+    /** Arrays of at least this many bytes are put on huge pages.
+     */
+    std::size_t huge_page_threshold = huge_page_size;
+
+    /** Bind the memory to the NUMA node the store was made on.
+     */
+    bool numa = false;
+};
+
+/** What a store has mapped, for `--stats`.
+ */
+struct mapping_stats {
+    std::uint64_t mapped_bytes = 0;
+    std::uint64_t transparent_huge_bytes = 0;
+    std::uint64_t explicit_huge_bytes = 0;
+    // explicit huge page mappings which fell back to transparent ones
+    std::uint64_t explicit_fallbacks = 0;
+    // the node the mappings are bound to, or -1
+    int numa_node = -1;
+    std::uint64_t numa_bound_bytes = 0;
+    std::uint64_t numa_failures = 0;
+};
+
+/** Maps anonymous memory for an array store as its `mapping_options` ask.
+ */
+class memory_mapper {
+private:
+    mapping_options m_options;
+    mapping_stats m_stats;
+
+    static int current_node() {
+        unsigned cpu;
+        unsigned node;
+        if (syscall(SYS_getcpu, &cpu, &node, nullptr) < 0) {
+            return -1;
+        }
+        return node;
+    }
+
+    /** Bind `[data, data + size)` to our node before anything touches it.
+     */
+    void bind(void* data, std::size_t size) {
+        if (m_stats.numa_node < 0) {
+            return;
+        }
+        unsigned long mask = 1ul << m_stats.numa_node;
+        if (syscall(SYS_mbind, data, size, MPOL_BIND, &mask, sizeof(mask) * 8 + 1, 0) <
+            0) {
+            ++m_stats.numa_failures;
+            return;
+        }
+        m_stats.numa_bound_bytes += size;
+    }
+
+    static void* map(std::size_t size, int flags) {
+        return mmap(nullptr,
+                    size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | flags,
+                    -1,
+                    0);
+    }
+
+    /** Map `size` bytes aligned to a huge page and ask for transparent huge pages.
+     */
+    void* map_transparent(std::size_t size) {
+        std::size_t align = mapping_options::huge_page_size;
+        void* raw = map(size + align, 0);
+        if (raw == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        auto begin = reinterpret_cast<std::uintptr_t>(raw);
+        std::uintptr_t aligned = (begin + align - 1) & ~(align - 1);
+        if (aligned != begin) {
+            munmap(raw, aligned - begin);
+        }
+        if (std::size_t tail = align - (aligned - begin)) {
+            munmap(reinterpret_cast<void*>(aligned + size), tail);
+        }
+        void* data = reinterpret_cast<void*>(aligned);
+        madvise(data, size, MADV_HUGEPAGE);
+        m_stats.transparent_huge_bytes += size;
+        return data;
+    }
+
+public:
+    /** Make a mapper which binds to the NUMA node of the calling thread if
+        `options.numa` is set.
+     */
+    explicit memory_mapper(const mapping_options& options) : m_options(options) {
+        if (m_options.numa) {
+            m_stats.numa_node = current_node();
+            if (m_stats.numa_node < 0 || m_stats.numa_node >= 63) {
+                m_stats.numa_node = -1;
+                ++m_stats.numa_failures;
+            }
+        }
+    }
+
+    /** Whether an array of `bytes` should be mapped with `map_huge()`.
+     */
+    bool wants_huge(std::size_t bytes) const {
+        return m_options.pages != mapping_options::huge_pages::off &&
+               bytes >= m_options.huge_page_threshold;
+    }
+
+    /** Map `size` bytes of ordinary pages.
+     */
+    void* map_normal(std::size_t size) {
+        void* data = map(size, 0);
+        if (data == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        m_stats.mapped_bytes += size;
+        bind(data, size);
+        return data;
+    }
+
+    /** Map `size` bytes, which must be a multiple of
+        `mapping_options::huge_page_size`, of huge pages.
+     */
+    void* map_huge(std::size_t size) {
+        void* data = MAP_FAILED;
+        if (m_options.pages == mapping_options::huge_pages::explicit_pool) {
+            data = map(size, MAP_HUGETLB);
+            if (data == MAP_FAILED) {
+                ++m_stats.explicit_fallbacks;
+            }
+            else {
+                m_stats.explicit_huge_bytes += size;
+            }
+        }
+        if (data == MAP_FAILED) {
+            data = map_transparent(size);
+        }
+        m_stats.mapped_bytes += size;
+        bind(data, size);
+        return data;
+    }
+
+    const mapping_stats& stats() const {
+        return m_stats;
+    }
+};
+}  // namespace um
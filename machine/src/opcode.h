@@ -0,0 +1,247 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+
+namespace um {
+using platter = uint32_t;
+
+enum class opcode : uint8_t {
+    conditional_move = 0,
+    array_index = 1,
+    array_amendment = 2,
+    addition = 3,
+    multiplication = 4,
+    division = 5,
+    not_and = 6,
+    halt = 7,
+    allocation = 8,
+    abandonment = 9,
+    output = 10,
+    input = 11,
+    load_program = 12,
+    orthography = 13,
+};
+
+/** The operands of an instruction, as the bits of the masks in an `opcode_info`.
+    `orthography`'s `a` is the register it loads.
+ */
+enum operand : std::uint8_t {
+    no_operand = 0,
+    operand_a = 1,
+    operand_b = 2,
+    operand_c = 4,
+};
+
+/** What an instruction does besides reading and writing registers, as the bits
+    of `opcode_info::effects`.
+ */
+enum effect : std::uint8_t {
+    no_effects = 0,
+    reads_arrays = 1,
+    writes_arrays = 2,
+    // allocates or abandons an array
+    manages_arrays = 4,
+    does_io = 8,
+    // moves the execution finger anywhere but the next instruction
+    jumps = 16,
+    // halts the machine, or may stop it before the instruction runs
+    may_stop = 32,
+};
+
+/** What the engines need to know about an opcode, so that they can be written
+    once over `opcodes` instead of once for each opcode.
+
+    Entries are built up with the member functions, as in
+    `opcode_info{"output"}.reading(operand_c).checking_byte(operand_c)`.
+ */
+struct opcode_info {
+    const char* name;
+    // the operands the opcode reads and writes as registers
+    std::uint8_t reads = no_operand;
+    std::uint8_t writes = no_operand;
+    std::uint8_t effects = no_effects;
+    // what the checked engine checks first: an operand which must not be 0, and
+    // the fault if it is
+    std::uint8_t nonzero = no_operand;
+    const char* zero_fault = nullptr;
+    // an operand holding an array which must be live, and one holding an index
+    // which must be in its bounds
+    std::uint8_t array = no_operand;
+    std::uint8_t index = no_operand;
+    // an operand which must hold a byte
+    std::uint8_t byte = no_operand;
+    // whether the switch engine guesses that the next opcode is `successor`, and
+    // tries it before going back through its switch
+    bool predicted = false;
+    opcode successor = opcode::conditional_move;
+
+    constexpr opcode_info reading(std::uint8_t operands) const {
+        opcode_info out = *this;
+        out.reads = operands;
+        return out;
+    }
+
+    constexpr opcode_info writing(std::uint8_t operands) const {
+        opcode_info out = *this;
+        out.writes = operands;
+        return out;
+    }
+
+    constexpr opcode_info with_effects(std::uint8_t e) const {
+        opcode_info out = *this;
+        out.effects = e;
+        return out;
+    }
+
+    constexpr opcode_info checking_nonzero(std::uint8_t operand, const char* fault) const {
+        opcode_info out = *this;
+        out.nonzero = operand;
+        out.zero_fault = fault;
+        return out;
+    }
+
+    constexpr opcode_info checking_array(std::uint8_t operand) const {
+        opcode_info out = *this;
+        out.array = operand;
+        return out;
+    }
+
+    constexpr opcode_info checking_index(std::uint8_t array_operand,
+                                         std::uint8_t index_operand) const {
+        opcode_info out = checking_array(array_operand);
+        out.index = index_operand;
+        return out;
+    }
+
+    constexpr opcode_info checking_byte(std::uint8_t operand) const {
+        opcode_info out = *this;
+        out.byte = operand;
+        return out;
+    }
+
+    constexpr opcode_info predicting(opcode next) const {
+        opcode_info out = *this;
+        out.predicted = true;
+        out.successor = next;
+        return out;
+    }
+
+    /** Whether the opcode always goes on to the next instruction, so that it may
+        run in the middle of a superinstruction.
+     */
+    constexpr bool straight_line() const {
+        return !(effects & (jumps | may_stop));
+    }
+};
+
+/** The `opcode_info` of each opcode, indexed by the opcode.
+
+    The predictions were picked from `--stats` runs of `uml` programs: the opcode
+    which most often follows each site, where it follows often enough to pay for
+    the check.
+ */
+inline constexpr std::array<opcode_info, 14> opcodes = {
+    opcode_info{"conditional_move"}
+        .reading(operand_a | operand_b | operand_c)
+        .writing(operand_a)
+        .predicting(opcode::load_program),
+    opcode_info{"array_index"}
+        .reading(operand_b | operand_c)
+        .writing(operand_a)
+        .with_effects(reads_arrays)
+        .checking_index(operand_b, operand_c),
+    opcode_info{"array_amendment"}
+        .reading(operand_a | operand_b | operand_c)
+        .with_effects(writes_arrays)
+        .checking_index(operand_a, operand_b)
+        .predicting(opcode::orthography),
+    opcode_info{"addition"}.reading(operand_b | operand_c).writing(operand_a),
+    opcode_info{"multiplication"}.reading(operand_b | operand_c).writing(operand_a),
+    opcode_info{"division"}
+        .reading(operand_b | operand_c)
+        .writing(operand_a)
+        .checking_nonzero(operand_c, "division by zero"),
+    opcode_info{"not_and"}.reading(operand_b | operand_c).writing(operand_a),
+    opcode_info{"halt"}.with_effects(may_stop),
+    opcode_info{"allocation"}
+        .reading(operand_c)
+        .writing(operand_b)
+        .with_effects(manages_arrays)
+        .predicting(opcode::orthography),
+    opcode_info{"abandonment"}
+        .reading(operand_c)
+        .with_effects(manages_arrays)
+        .checking_nonzero(operand_c, "abandoning array 0")
+        .checking_array(operand_c)
+        .predicting(opcode::conditional_move),
+    opcode_info{"output"}
+        .reading(operand_c)
+        .with_effects(does_io)
+        .checking_byte(operand_c)
+        .predicting(opcode::orthography),
+    opcode_info{"input"}.writing(operand_c).with_effects(does_io | may_stop),
+    opcode_info{"load_program"}
+        .reading(operand_b | operand_c)
+        .with_effects(jumps)
+        .checking_array(operand_b),
+    opcode_info{"orthography"}.writing(operand_a),
+};
+
+constexpr const opcode_info& describe(opcode op) {
+    return opcodes[static_cast<std::size_t>(op)];
+}
+
+inline const std::array<std::string, 14> opname = [] {
+    std::array<std::string, 14> names;
+    for (std::size_t op = 0; op < opcodes.size(); ++op) {
+        names[op] = opcodes[op].name;
+    }
+    return names;
+}();
+
+/** Call `f` with the `std::integral_constant` of `op`, so that it can be
+    specialized on the opcode. `op` must be valid.
+ */
+template<typename F>
+void with_opcode(opcode op, F&& f) {
+#define UM_CASE(ix)                                                                      \
+    case static_cast<opcode>(ix):                                                        \
+        f(std::integral_constant<opcode, static_cast<opcode>(ix)>{});                    \
+        return
+    static_assert(opcodes.size() == 14, "with_opcode() needs a case for every opcode");
+    switch (op) {
+        UM_CASE(0);
+        UM_CASE(1);
+        UM_CASE(2);
+        UM_CASE(3);
+        UM_CASE(4);
+        UM_CASE(5);
+        UM_CASE(6);
+        UM_CASE(7);
+        UM_CASE(8);
+        UM_CASE(9);
+        UM_CASE(10);
+        UM_CASE(11);
+        UM_CASE(12);
+        UM_CASE(13);
+    default:
+        __builtin_unreachable();
+    }
+#undef UM_CASE
+}
+
+/** A run of opcodes which the decoded engine executes with a single dispatch.
+ */
+struct superinstruction {
+    std::uint8_t length;
+    std::array<opcode, 4> ops;
+};
+
+constexpr platter extract_bits(platter p, uint8_t start, uint8_t count) {
+    platter mask = ((1 << count) - 1) << start;
+    return (p & mask) >> start;
+}
+}  // namespace um
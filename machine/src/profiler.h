@@ -0,0 +1,187 @@
+#pragma once
+
+#include <sys/time.h>
+
+#include <array>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <tuple>
+
+#include "opcode.h"
+
+namespace um {
+/** The profiling hooks for a machine which isn't being profiled. Every hook is
+    empty, so the engines compile exactly as if they weren't there.
+ */
+struct no_profiler {
+    static constexpr bool enabled = false;
+
+    template<typename Arrays>
+    void sample(const Arrays&, std::size_t) {}
+
+    void load() {}
+
+    void amend(platter) {}
+
+    template<typename Arrays>
+    void dump(const Arrays&) {}
+};
+
+/** Hash the `size` platters of `array` as the profile and the UML compiler's
+    `--map` identify code arrays: FNV-1a over whole platters.
+ */
+template<typename Array>
+std::uint64_t hash_code_array(const Array& array, std::size_t size) {
+    std::uint64_t hash = 0xcbf29ce484222325;
+    for (std::size_t ix = 0; ix < size; ++ix) {
+        hash ^= array[ix];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+/** A sampling profiler, selected at runtime with `--profile=PATH`.
+
+    `SIGPROF` fires every `interval_us` of CPU time and asks for a sample, which
+    the engines take at the next instruction they dispatch: the finger and array
+    0's size and `hash_code_array()`. The hash is taken at the first sample after
+    array 0 is loaded or amended, and kept until the next load or amendment, so a
+    sample is charged to the code which was running when it was taken. Samples go
+    into a ring which is folded into counts whenever it fills.
+
+    At `halt` the counts are written to `path`, one line each of the array's size
+    and hash, the finger, and the number of samples, for `etc/profile-report` to
+    join with the UML compiler's `--map`.
+ */
+class machine_profiler {
+public:
+    static constexpr bool enabled = true;
+
+    /** Where to write the profile.
+     */
+    static inline const char* path = nullptr;
+
+    /** The time between samples, in microseconds of CPU time.
+     */
+    static inline long interval_us = 1000;
+
+private:
+    static inline volatile std::sig_atomic_t sample_requested = 0;
+
+    static constexpr std::size_t ring_size = 4096;
+
+    struct sample {
+        std::size_t size;
+        std::uint64_t hash;
+        platter finger;
+    };
+
+    std::array<sample, ring_size> m_ring;
+    std::size_t m_program_size = 0;
+    std::uint64_t m_program_hash = 0;
+    // whether `m_program_size` and `m_program_hash` are those of array 0
+    bool m_program_known = false;
+    std::size_t m_ring_used = 0;
+    // samples by array size, array hash, and finger
+    std::map<std::tuple<std::size_t, std::uint64_t, platter>, std::uint64_t> m_counts;
+
+    static void request_sample(int) {
+        sample_requested = 1;
+    }
+
+    static void set_timer(long us) {
+        itimerval timer{};
+        timer.it_interval.tv_sec = us / 1000000;
+        timer.it_interval.tv_usec = us % 1000000;
+        timer.it_value = timer.it_interval;
+        setitimer(ITIMER_PROF, &timer, nullptr);
+    }
+
+    /** Fold the ring into `m_counts`.
+     */
+    void fold() {
+        for (std::size_t ix = 0; ix < m_ring_used; ++ix) {
+            auto [size, hash, finger] = m_ring[ix];
+            ++m_counts[{size, hash, finger}];
+        }
+        m_ring_used = 0;
+    }
+
+public:
+    /** Install the `SIGPROF` handler and start the timer.
+     */
+    machine_profiler() {
+        struct sigaction action {};
+        action.sa_handler = request_sample;
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGPROF, &action, nullptr);
+        set_timer(interval_us);
+    }
+
+    machine_profiler(const machine_profiler&) = delete;
+    machine_profiler& operator=(const machine_profiler&) = delete;
+
+    ~machine_profiler() {
+        set_timer(0);
+    }
+
+    /** Take a sample at the instruction at `finger` if one is due.
+     */
+    template<typename Arrays>
+    void sample(const Arrays& arrays, std::size_t finger) {
+        if (__builtin_expect(sample_requested, 0)) {
+            sample_requested = 0;
+            if (!m_program_known) {
+                m_program_size = arrays.size(0);
+                m_program_hash = hash_code_array(arrays[0], m_program_size);
+                m_program_known = true;
+            }
+            m_ring[m_ring_used++] = {m_program_size,
+                                     m_program_hash,
+                                     static_cast<platter>(finger)};
+            if (m_ring_used == ring_size) {
+                fold();
+            }
+        }
+    }
+
+    /** Call when array 0 is replaced by `load_program`.
+     */
+    void load() {
+        m_program_known = false;
+    }
+
+    /** Call when `array_amendment` writes to the array at `address`.
+     */
+    void amend(platter address) {
+        if (!address) {
+            m_program_known = false;
+        }
+    }
+
+    /** Write the profile to `path`.
+     */
+    template<typename Arrays>
+    void dump(const Arrays&) {
+        fold();
+        std::FILE* out = std::fopen(path, "w");
+        if (!out) {
+            std::perror(path);
+            return;
+        }
+        std::fprintf(out, "# size hash finger samples\n");
+        for (const auto& [key, count] : m_counts) {
+            auto [size, hash, finger] = key;
+            std::fprintf(out,
+                         "%zu %016llx %u %llu\n",
+                         size,
+                         static_cast<unsigned long long>(hash),
+                         finger,
+                         static_cast<unsigned long long>(count));
+        }
+        std::fclose(out);
+    }
+};
+}  // namespace um
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "decoded_program.h"
+#include "opcode.h"
+
+namespace um {
+/** What a linear scan over an array of code can tell about it before it runs.
+
+    The array is split into basic blocks: a block starts at index 0, after every
+    `load_program`, `halt` or invalid opcode, and at every target of a
+    `load_program` which jumps within the array to a constant finger. Within a
+    block the registers are tracked as unknown, known not to be zero (the result of
+    `allocation`), a constant (from `orthography` and arithmetic on constants), or
+    one of two constants (from a `conditional_move` between them, which is how a
+    conditional branch picks its target); every block starts with them all unknown.
+
+    The facts hold as long as jumps whose target isn't constant land on the start
+    of a block, which is where calls and returns land in the code the UML compiler
+    emits: at 0, or just after the `load_program` which made the call.
+ */
+struct program_analysis {
+    /** Whether each instruction starts a basic block.
+     */
+    std::vector<bool> block_starts;
+    std::size_t blocks = 0;
+
+    /** The distinct constant fingers which `load_program` may jump to within the
+        array, in order.
+     */
+    std::vector<platter> jump_targets;
+
+    /** `load_program`s jumping within the array to a finger which is one of at most
+        two constants.
+     */
+    std::size_t static_jumps = 0;
+
+    /** `load_program`s which replace array 0 with another array.
+     */
+    std::size_t far_jumps = 0;
+
+    /** `load_program`s whose array or finger isn't known.
+     */
+    std::size_t dynamic_jumps = 0;
+
+    std::size_t amendments = 0;
+
+    /** `array_amendment`s whose array isn't known not to be array 0.
+     */
+    std::size_t code_amendments = 0;
+
+    /** Whether nothing in the array can write to array 0, so that once it is loaded
+        its decoding and compiled blocks never go stale.
+     */
+    bool code_immutable() const {
+        return !code_amendments;
+    }
+};
+
+namespace detail {
+/** What a register is known to hold.
+ */
+struct known_value {
+    enum kind_type : std::uint8_t { unknown, nonzero, constant, either };
+
+    kind_type kind = unknown;
+    platter value = 0;
+    // the other value for `either`
+    platter other = 0;
+
+    static known_value of(platter value) {
+        return {constant, value, 0};
+    }
+
+    bool is_constant() const {
+        return kind == constant;
+    }
+
+    bool is_nonzero() const {
+        return kind == nonzero || (kind == constant && value) ||
+               (kind == either && value && other);
+    }
+
+    bool is_zero() const {
+        return kind == constant && !value;
+    }
+
+    /** What a register holds after a `conditional_move` which may or may not
+        happen.
+     */
+    static known_value join(known_value a, known_value b) {
+        if (a.is_constant() && b.is_constant()) {
+            return a.value == b.value ? a : known_value{either, a.value, b.value};
+        }
+        if (a.is_nonzero() && b.is_nonzero()) {
+            return {nonzero, 0, 0};
+        }
+        return {};
+    }
+};
+
+using known_registers = std::array<known_value, 8>;
+
+/** Walk the array one block at a time, calling `amend(a)` and `jump(b, c)` with
+    what is known about the operands of each `array_amendment` and `load_program`.
+ */
+template<typename Program, typename Amend, typename Jump>
+void propagate(const Program& program,
+               std::size_t size,
+               const std::vector<bool>& block_starts,
+               Amend&& amend,
+               Jump&& jump) {
+    known_registers r;
+    for (std::size_t ix = 0; ix < size; ++ix) {
+        if (block_starts[ix]) {
+            r = known_registers{};
+        }
+        decoded_instruction i = decoded_instruction::decode(program[ix]);
+        auto fold = [&](auto f) {
+            if (r[i.b].is_constant() && r[i.c].is_constant()) {
+                r[i.a] = known_value::of(f(r[i.b].value, r[i.c].value));
+            }
+            else {
+                r[i.a] = {};
+            }
+        };
+        switch (static_cast<opcode>(i.op)) {
+        case opcode::conditional_move:
+            if (r[i.c].is_nonzero()) {
+                r[i.a] = r[i.b];
+            }
+            else if (!r[i.c].is_zero()) {
+                r[i.a] = known_value::join(r[i.a], r[i.b]);
+            }
+            break;
+        case opcode::array_index:
+            r[i.a] = {};
+            break;
+        case opcode::array_amendment:
+            amend(r[i.a]);
+            break;
+        case opcode::addition:
+            fold([](platter b, platter c) { return b + c; });
+            break;
+        case opcode::multiplication:
+            fold([](platter b, platter c) { return b * c; });
+            break;
+        case opcode::division:
+            if (r[i.c].is_constant() && !r[i.c].value) {
+                r[i.a] = {};
+            }
+            else {
+                fold([](platter b, platter c) { return b / c; });
+            }
+            break;
+        case opcode::not_and:
+            fold([](platter b, platter c) { return ~(b & c); });
+            break;
+        case opcode::allocation:
+            r[i.b] = {known_value::nonzero, 0, 0};
+            break;
+        case opcode::input:
+            r[i.c] = {};
+            break;
+        case opcode::load_program:
+            jump(r[i.b], r[i.c]);
+            break;
+        case opcode::orthography:
+            r[i.a] = known_value::of(i.value);
+            break;
+        default:
+            // halt, abandonment, output, and the invalid opcodes change no registers
+            break;
+        }
+    }
+}
+}  // namespace detail
+
+/** Analyse the `size` instructions of `program`, which is indexed like the
+    store's `program()` view.
+ */
+template<typename Program>
+program_analysis analyze_program(const Program& program, std::size_t size) {
+    program_analysis out;
+    out.block_starts.assign(size, false);
+    if (!size) {
+        return out;
+    }
+    out.block_starts[0] = true;
+    for (std::size_t ix = 0; ix + 1 < size; ++ix) {
+        std::uint8_t op = program[ix] >> 28;
+        if (op == static_cast<std::uint8_t>(opcode::load_program) ||
+            op == static_cast<std::uint8_t>(opcode::halt) || op > 13) {
+            out.block_starts[ix + 1] = true;
+        }
+    }
+
+    // call `f(target)` for each finger a local jump may go to, or return false
+    auto local_targets = [&](detail::known_value b, detail::known_value c, auto f) {
+        if (!b.is_zero() || (!c.is_constant() && c.kind != detail::known_value::either) ||
+            c.value >= size || (c.kind == detail::known_value::either && c.other >= size)) {
+            return false;
+        }
+        f(c.value);
+        if (c.kind == detail::known_value::either) {
+            f(c.other);
+        }
+        return true;
+    };
+    auto add_target = [&](platter target) { out.jump_targets.push_back(target); };
+
+    // Find the targets with the blocks only split after jumps. Splitting them at
+    // the targets too can only lose facts, so the second pass finds no targets
+    // this one didn't.
+    detail::propagate(
+        program,
+        size,
+        out.block_starts,
+        [](detail::known_value) {},
+        [&](detail::known_value b, detail::known_value c) {
+            local_targets(b, c, add_target);
+        });
+    for (platter target : out.jump_targets) {
+        out.block_starts[target] = true;
+    }
+    out.jump_targets.clear();
+
+    detail::propagate(
+        program,
+        size,
+        out.block_starts,
+        [&](detail::known_value a) {
+            ++out.amendments;
+            if (!a.is_nonzero()) {
+                ++out.code_amendments;
+            }
+        },
+        [&](detail::known_value b, detail::known_value c) {
+            if (local_targets(b, c, add_target)) {
+                ++out.static_jumps;
+            }
+            else if (b.is_nonzero()) {
+                ++out.far_jumps;
+            }
+            else {
+                ++out.dynamic_jumps;
+            }
+        });
+    std::sort(out.jump_targets.begin(), out.jump_targets.end());
+    out.jump_targets.erase(std::unique(out.jump_targets.begin(), out.jump_targets.end()),
+                           out.jump_targets.end());
+    out.blocks = std::count(out.block_starts.begin(), out.block_starts.end(), true);
+    return out;
+}
+}  // namespace um
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <system_error>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "opcode.h"
+
+namespace um {
+struct malformed_program : public std::invalid_argument {
+public:
+    malformed_program() : std::invalid_argument("malformed_program") {}
+};
+
+namespace detail {
+inline void byteswap_scalar(platter* out, const platter* in, std::size_t count) {
+    for (std::size_t ix = 0; ix < count; ++ix) {
+        out[ix] = __builtin_bswap32(in[ix]);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) inline void
+byteswap_avx2(platter* out, const platter* in, std::size_t count) {
+    const __m256i mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14,
+                                          13, 12, 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8,
+                                          15, 14, 13, 12);
+    std::size_t ix = 0;
+    for (; ix + 8 <= count; ix += 8) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + ix));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + ix),
+                            _mm256_shuffle_epi8(v, mask));
+    }
+    byteswap_scalar(out + ix, in + ix, count - ix);
+}
+
+__attribute__((target("ssse3"))) inline void
+byteswap_ssse3(platter* out, const platter* in, std::size_t count) {
+    const __m128i mask =
+        _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    std::size_t ix = 0;
+    for (; ix + 4 <= count; ix += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + ix));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + ix), _mm_shuffle_epi8(v, mask));
+    }
+    byteswap_scalar(out + ix, in + ix, count - ix);
+}
+#endif
+}  // namespace detail
+
+/** Convert `count` big-endian platters to native order. `out` may be `in`.
+
+    This uses `pshufb` when the CPU has it, picked once at runtime.
+ */
+inline void byteswap(platter* out, const platter* in, std::size_t count) {
+#if defined(__x86_64__) || defined(__i386__)
+    using kernel = void (*)(platter*, const platter*, std::size_t);
+    static const kernel impl = [] {
+        if (__builtin_cpu_supports("avx2")) {
+            return static_cast<kernel>(detail::byteswap_avx2);
+        }
+        if (__builtin_cpu_supports("ssse3")) {
+            return static_cast<kernel>(detail::byteswap_ssse3);
+        }
+        return static_cast<kernel>(detail::byteswap_scalar);
+    }();
+    impl(out, in, count);
+#else
+    detail::byteswap_scalar(out, in, count);
+#endif
+}
+
+/** A UM image mapped into memory.
+
+    The file is mapped privately, so converting it to native byte order in place
+    only copies the pages it touches, and the file on disk is never changed. A
+    native image, written by `write_native()`, starts with `native_magic` and may be
+    used as is.
+ */
+class program_image {
+public:
+    static constexpr char native_magic[8] = {'U', 'M', '3', '2', 'N', 'A', 'T', 0};
+    static constexpr std::uint32_t native_version = 1;
+
+    /** The header of a native image. The platters follow immediately.
+     */
+    struct native_header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t reserved;
+    };
+
+private:
+    void* m_mapping = nullptr;
+    std::size_t m_mapping_size = 0;
+    platter* m_platters = nullptr;
+    std::size_t m_size = 0;
+    bool m_native = false;
+
+public:
+    explicit program_image(const char* path) {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        struct stat st;
+        if (fstat(fd, &st)) {
+            int err = errno;
+            ::close(fd);
+            throw std::system_error(err, std::generic_category(), path);
+        }
+        m_mapping_size = st.st_size;
+
+        if (m_mapping_size) {
+            m_mapping = mmap(nullptr,
+                             m_mapping_size,
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE,
+                             fd,
+                             0);
+        }
+        int err = errno;
+        ::close(fd);
+        if (m_mapping == MAP_FAILED) {
+            m_mapping = nullptr;
+            throw std::system_error(err, std::generic_category(), path);
+        }
+
+        auto* bytes = static_cast<char*>(m_mapping);
+        std::size_t offset = 0;
+        bool valid = true;
+        if (m_mapping_size >= sizeof(native_header) &&
+            !std::memcmp(bytes, native_magic, sizeof(native_magic))) {
+            native_header header;
+            std::memcpy(&header, bytes, sizeof(header));
+            valid = header.version == native_version;
+            offset = sizeof(native_header);
+            m_native = true;
+        }
+
+        if (!valid || (m_mapping_size - offset) % sizeof(platter)) {
+            munmap(m_mapping, m_mapping_size);
+            m_mapping = nullptr;
+            throw malformed_program();
+        }
+        m_platters = reinterpret_cast<platter*>(bytes + offset);
+        m_size = (m_mapping_size - offset) / sizeof(platter);
+        madvise(m_mapping, m_mapping_size, MADV_SEQUENTIAL);
+    }
+
+    program_image(const program_image&) = delete;
+    program_image& operator=(const program_image&) = delete;
+
+    program_image(program_image&& other)
+        : m_mapping(other.m_mapping),
+          m_mapping_size(other.m_mapping_size),
+          m_platters(other.m_platters),
+          m_size(other.m_size),
+          m_native(other.m_native) {
+        other.m_mapping = nullptr;
+    }
+
+    ~program_image() {
+        if (m_mapping) {
+            munmap(m_mapping, m_mapping_size);
+        }
+    }
+
+    /** The number of platters in the program.
+     */
+    std::size_t size() const {
+        return m_size;
+    }
+
+    /** Whether the image was already in native byte order.
+     */
+    bool native() const {
+        return m_native;
+    }
+
+    /** Write the program in native byte order to `out`.
+     */
+    void copy_to(platter* out) const {
+        copy_to(out, 0, m_size);
+    }
+
+    /** Write `count` platters starting at `begin` in native byte order to `out`.
+     */
+    void copy_to(platter* out, std::size_t begin, std::size_t count) const {
+        if (m_native) {
+            std::memcpy(out, m_platters + begin, count * sizeof(platter));
+        }
+        else {
+            byteswap(out, m_platters + begin, count);
+        }
+    }
+
+    struct mapped_program {
+        void* mapping;
+        std::size_t mapping_size;
+        platter* platters;
+        std::size_t size;
+    };
+
+    /** Convert the mapping to native byte order in place and hand it over.
+
+        The caller must `munmap(mapping, mapping_size)` when it is done with the
+        platters.
+     */
+    mapped_program release() {
+        if (!m_native) {
+            byteswap(m_platters, m_platters, m_size);
+            m_native = true;
+        }
+        mapped_program out = {m_mapping, m_mapping_size, m_platters, m_size};
+        m_mapping = nullptr;
+        return out;
+    }
+
+    /** Save the program as a native image which can be mapped with no conversion.
+     */
+    void write_native(const char* path) const {
+        std::fstream out(path, out.out | out.binary | out.trunc);
+        if (!out) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        native_header header = {};
+        std::memcpy(header.magic, native_magic, sizeof(native_magic));
+        header.version = native_version;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        if (m_native) {
+            out.write(reinterpret_cast<const char*>(m_platters),
+                      m_size * sizeof(platter));
+        }
+        else {
+            platter buffer[4096];
+            for (std::size_t ix = 0; ix < m_size; ix += std::size(buffer)) {
+                std::size_t count = std::min(std::size(buffer), m_size - ix);
+                byteswap(buffer, m_platters + ix, count);
+                out.write(reinterpret_cast<const char*>(buffer),
+                          count * sizeof(platter));
+            }
+        }
+        if (!out.flush()) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+    }
+};
+}  // namespace um
@@ -0,0 +1,310 @@
+#pragma once
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "io.h"
+#include "machine_status.h"
+
+namespace um {
+/** Run many interactive machines, each talking to one socket, on a few threads.
+
+    A machine whose `input` finds nothing to read stops with
+    `machine_status::waiting_for_input` instead of blocking its thread, and its
+    socket is handed to epoll; when data arrives the machine is resumed from that
+    `input`. Each session stays on the worker it was given, so a machine is only
+    ever touched by one thread.
+
+    A session runs without interruption until it waits or halts, so a long
+    computation holds up the other sessions on its worker. Output is written with
+    blocking sends, so a client which doesn't read its output does the same.
+
+    A worker whose epoll set fails reports it, closes its sessions and takes no new
+    ones; the other workers carry on.
+
+    @tparam Machine A `basic_machine`.
+ */
+template<typename Machine>
+class session_scheduler {
+public:
+    /** Make the machine for a new session which uses `io` as its console.
+     */
+    using factory = std::function<std::unique_ptr<Machine>(machine_io io)>;
+
+    /** Run `m` until it halts or waits for input.
+     */
+    using runner = std::function<void(Machine& m)>;
+
+private:
+    struct session {
+        int fd;
+        std::unique_ptr<Machine> machine;
+
+        ~session() {
+            // destroy the machine first, it may flush its output to the socket
+            machine.reset();
+            ::close(fd);
+        }
+    };
+
+    class worker {
+    private:
+        session_scheduler& m_scheduler;
+        int m_epoll;
+        int m_wake;
+        std::mutex m_lock;
+        std::vector<int> m_incoming;
+        std::map<int, std::unique_ptr<session>> m_sessions;
+        // set under `m_lock` once the worker has stopped taking sessions
+        bool m_failed = false;
+        std::thread m_thread;
+
+        static void check(int result, const char* what) {
+            if (result < 0) {
+                throw std::system_error(errno, std::generic_category(), what);
+            }
+        }
+
+        void watch(int fd) {
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+            check(epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event), "epoll_ctl");
+        }
+
+        /** Run the session on `fd` until it waits for input again or halts.
+         */
+        void resume(int fd) {
+            auto it = m_sessions.find(fd);
+            if (it == m_sessions.end()) {
+                return;
+            }
+            Machine& m = *it->second->machine;
+            try {
+                m_scheduler.m_run(m);
+                if (m.status() == machine_status::waiting_for_input) {
+                    return;
+                }
+            }
+            catch (const std::exception& e) {
+                std::cerr << "session " << fd << ": " << e.what() << '\n';
+            }
+            // closing the fd takes it out of the epoll set
+            m_sessions.erase(it);
+            --m_scheduler.m_session_count;
+        }
+
+        void start(int fd) {
+            auto s = std::make_unique<session>();
+            s->fd = fd;
+            try {
+                s->machine = m_scheduler.m_make(
+                    machine_io(m_scheduler.m_mode, read_socket(fd), write_socket(fd)));
+                watch(fd);
+            }
+            catch (const std::exception& e) {
+                std::cerr << "session " << fd << ": " << e.what() << '\n';
+                --m_scheduler.m_session_count;
+                return;
+            }
+            m_sessions.emplace(fd, std::move(s));
+            // the program may have something to say before it reads anything
+            resume(fd);
+        }
+
+        void wait_for_events() {
+            std::vector<epoll_event> events(64);
+            while (!m_scheduler.m_stopping) {
+                int count = epoll_wait(m_epoll, events.data(), events.size(), -1);
+                if (count < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::system_error(errno, std::generic_category(), "epoll_wait");
+                }
+                for (int ix = 0; ix < count; ++ix) {
+                    int fd = events[ix].data.fd;
+                    if (fd != m_wake) {
+                        resume(fd);
+                        continue;
+                    }
+                    std::uint64_t wakes;
+                    [[maybe_unused]] ssize_t size = ::read(m_wake, &wakes, sizeof(wakes));
+                    std::vector<int> incoming;
+                    {
+                        std::lock_guard<std::mutex> guard(m_lock);
+                        incoming.swap(m_incoming);
+                    }
+                    for (int new_fd : incoming) {
+                        start(new_fd);
+                    }
+                }
+            }
+        }
+
+        void run() {
+            try {
+                wait_for_events();
+            }
+            catch (const std::exception& e) {
+                std::vector<int> incoming;
+                {
+                    std::lock_guard<std::mutex> guard(m_lock);
+                    m_failed = true;
+                    incoming.swap(m_incoming);
+                }
+                std::size_t closed = m_sessions.size() + incoming.size();
+                std::cerr << e.what() << ": closing " << closed << " sessions\n";
+                for (int fd : incoming) {
+                    ::close(fd);
+                }
+                m_sessions.clear();
+                m_scheduler.m_session_count -= closed;
+            }
+        }
+
+    public:
+        explicit worker(session_scheduler& scheduler)
+            : m_scheduler(scheduler),
+              m_epoll(epoll_create1(EPOLL_CLOEXEC)),
+              m_wake(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {
+            check(m_epoll, "epoll_create1");
+            check(m_wake, "eventfd");
+            watch(m_wake);
+            m_thread = std::thread([this] { run(); });
+        }
+
+        ~worker() {
+            wake();
+            m_thread.join();
+            m_sessions.clear();
+            for (int fd : m_incoming) {
+                ::close(fd);
+            }
+            ::close(m_wake);
+            ::close(m_epoll);
+        }
+
+        /** Hand the worker a new session on `fd`.
+
+            @return Whether the worker took it, which it doesn't once it has failed.
+         */
+        bool add(int fd) {
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                if (m_failed) {
+                    return false;
+                }
+                m_incoming.push_back(fd);
+            }
+            wake();
+            return true;
+        }
+
+        void wake() {
+            std::uint64_t one = 1;
+            [[maybe_unused]] ssize_t size = ::write(m_wake, &one, sizeof(one));
+        }
+    };
+
+    factory m_make;
+    runner m_run;
+    io_mode m_mode;
+    std::atomic<bool> m_stopping = false;
+    std::atomic<std::size_t> m_session_count = 0;
+    std::size_t m_next_worker = 0;
+    std::vector<std::unique_ptr<worker>> m_workers;
+
+public:
+    /** Read what is available from a socket without blocking.
+     */
+    static machine_io::reader read_socket(int fd) {
+        return [fd](unsigned char* buffer, std::size_t capacity) -> std::ptrdiff_t {
+            ssize_t count;
+            do {
+                count = ::recv(fd, buffer, capacity, MSG_DONTWAIT);
+            } while (count < 0 && errno == EINTR);
+            if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return machine_io::would_block;
+            }
+            // a reset connection is the end of the input
+            return count < 0 ? 0 : count;
+        };
+    }
+
+    /** Write to a socket without raising `SIGPIPE` if the peer has gone.
+     */
+    static machine_io::writer write_socket(int fd) {
+        return [fd](const unsigned char* data, std::size_t size) {
+            std::size_t written = 0;
+            while (written < size) {
+                ssize_t count = ::send(fd, data + written, size - written, MSG_NOSIGNAL);
+                if (count < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::system_error(errno, std::generic_category(), "output");
+                }
+                written += count;
+            }
+        };
+    }
+
+    session_scheduler(std::size_t threads, factory make, runner run, io_mode mode)
+        : m_make(std::move(make)), m_run(std::move(run)), m_mode(mode) {
+        for (std::size_t ix = 0; ix < std::max<std::size_t>(1, threads); ++ix) {
+            m_workers.emplace_back(std::make_unique<worker>(*this));
+        }
+    }
+
+    session_scheduler(const session_scheduler&) = delete;
+    session_scheduler& operator=(const session_scheduler&) = delete;
+
+    /** Stop the workers and close every session, running or not.
+     */
+    ~session_scheduler() {
+        m_stopping = true;
+        m_workers.clear();
+    }
+
+    /** Start a session on the connected socket `fd`, which the scheduler takes
+        ownership of. Sessions are dealt to the workers which haven't failed in
+        turn; if they all have, the socket is closed.
+     */
+    void add(int fd) {
+        ++m_session_count;
+        for (std::size_t tries = 0; tries < m_workers.size(); ++tries) {
+            worker& w = *m_workers[m_next_worker];
+            m_next_worker = (m_next_worker + 1) % m_workers.size();
+            if (w.add(fd)) {
+                return;
+            }
+        }
+        std::cerr << "session " << fd << ": every worker has failed\n";
+        ::close(fd);
+        --m_session_count;
+    }
+
+    /** The number of sessions which haven't halted.
+     */
+    std::size_t sessions() const {
+        return m_session_count;
+    }
+};
+}  // namespace um
@@ -0,0 +1,222 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <system_error>
+#include <vector>
+
+#include "opcode.h"
+#include "program_image.h"
+
+namespace um {
+/** A saved machine: the registers, the execution finger, and every array.
+
+    The file is a `header`, the size of every array handle, the free handles, and
+    then the contents of each array back to back, all in native byte order. A
+    snapshot is mapped privately when it is opened, so a store may use the array
+    contents where they are and let them fault in as the program touches them.
+ */
+class snapshot {
+public:
+    static constexpr char magic[8] = {'U', 'M', '3', '2', 'S', 'N', 'P', 0};
+    static constexpr std::uint32_t version = 1;
+
+    struct header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t array_count;
+        std::uint32_t free_count;
+        std::uint32_t reserved;
+        std::uint64_t execution_finger;
+        std::array<platter, 8> registers;
+    };
+
+    struct mapping {
+        void* data;
+        std::size_t size;
+    };
+
+private:
+    mapping m_mapping = {nullptr, 0};
+    header m_header;
+    const platter* m_sizes = nullptr;
+    const platter* m_free_handles = nullptr;
+    platter* m_contents = nullptr;
+
+    [[noreturn]] void malformed() {
+        munmap(m_mapping.data, m_mapping.size);
+        m_mapping = {nullptr, 0};
+        throw malformed_program();
+    }
+
+public:
+    explicit snapshot(const char* path) {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        struct stat st;
+        if (fstat(fd, &st)) {
+            int err = errno;
+            ::close(fd);
+            throw std::system_error(err, std::generic_category(), path);
+        }
+        if (static_cast<std::size_t>(st.st_size) < sizeof(header)) {
+            ::close(fd);
+            throw malformed_program();
+        }
+        m_mapping.size = st.st_size;
+        m_mapping.data =
+            mmap(nullptr, m_mapping.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        int err = errno;
+        ::close(fd);
+        if (m_mapping.data == MAP_FAILED) {
+            m_mapping = {nullptr, 0};
+            throw std::system_error(err, std::generic_category(), path);
+        }
+
+        auto* bytes = static_cast<char*>(m_mapping.data);
+        std::memcpy(&m_header, bytes, sizeof(header));
+        if (std::memcmp(m_header.magic, magic, sizeof(magic)) ||
+            m_header.version != version) {
+            malformed();
+        }
+        std::size_t tables =
+            (std::size_t(m_header.array_count) + m_header.free_count) * sizeof(platter);
+        if (m_mapping.size < sizeof(header) + tables) {
+            malformed();
+        }
+        m_sizes = reinterpret_cast<const platter*>(bytes + sizeof(header));
+        m_free_handles = m_sizes + m_header.array_count;
+        m_contents = const_cast<platter*>(m_free_handles + m_header.free_count);
+
+        std::size_t total = 0;
+        for (std::size_t ix = 0; ix < m_header.array_count; ++ix) {
+            total += m_sizes[ix];
+        }
+        if (!m_header.array_count ||
+            m_mapping.size != sizeof(header) + tables + total * sizeof(platter)) {
+            malformed();
+        }
+
+        // the machine resumes at the finger and `allocate()` hands out the free
+        // handles without looking at them again
+        if (m_header.execution_finger >= m_sizes[0]) {
+            malformed();
+        }
+        std::vector<bool> freed(m_header.array_count);
+        for (std::size_t ix = 0; ix < m_header.free_count; ++ix) {
+            platter address = m_free_handles[ix];
+            if (!address || address >= m_header.array_count || freed[address] ||
+                m_sizes[address]) {
+                malformed();
+            }
+            freed[address] = true;
+        }
+    }
+
+    snapshot(const snapshot&) = delete;
+    snapshot& operator=(const snapshot&) = delete;
+
+    snapshot(snapshot&& other)
+        : m_mapping(other.m_mapping),
+          m_header(other.m_header),
+          m_sizes(other.m_sizes),
+          m_free_handles(other.m_free_handles),
+          m_contents(other.m_contents) {
+        other.m_mapping = {nullptr, 0};
+    }
+
+    ~snapshot() {
+        if (m_mapping.data) {
+            munmap(m_mapping.data, m_mapping.size);
+        }
+    }
+
+    const std::array<platter, 8>& registers() const {
+        return m_header.registers;
+    }
+
+    std::size_t execution_finger() const {
+        return m_header.execution_finger;
+    }
+
+    /** The number of array handles, live or free.
+     */
+    std::size_t array_count() const {
+        return m_header.array_count;
+    }
+
+    std::size_t size(platter address) const {
+        return m_sizes[address];
+    }
+
+    std::vector<platter> free_handles() const {
+        return {m_free_handles, m_free_handles + m_header.free_count};
+    }
+
+    /** The contents of every array, back to back in handle order.
+     */
+    platter* contents() const {
+        return m_contents;
+    }
+
+    /** Hand the mapping over to a store which uses `contents()` in place. The
+        caller must `munmap(data, size)` when it is done with the arrays.
+     */
+    mapping release() {
+        mapping out = m_mapping;
+        m_mapping = {nullptr, 0};
+        return out;
+    }
+
+    /** Save a machine.
+
+        @param store The array store. This uses its `array_count()`, `size()`,
+               `free_handles()` and `read()`.
+     */
+    template<typename Store>
+    static void write(const char* path,
+                      const std::array<platter, 8>& registers,
+                      std::size_t execution_finger,
+                      const Store& store) {
+        std::fstream out(path, out.out | out.binary | out.trunc);
+        if (!out) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        const std::vector<platter>& free_handles = store.free_handles();
+
+        header h = {};
+        std::memcpy(h.magic, magic, sizeof(magic));
+        h.version = version;
+        h.array_count = store.array_count();
+        h.free_count = free_handles.size();
+        h.execution_finger = execution_finger;
+        h.registers = registers;
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+
+        for (std::size_t ix = 0; ix < store.array_count(); ++ix) {
+            platter size = store.size(ix);
+            out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+        }
+        out.write(reinterpret_cast<const char*>(free_handles.data()),
+                  free_handles.size() * sizeof(platter));
+        for (std::size_t ix = 0; ix < store.array_count(); ++ix) {
+            store.read(ix, [&](const platter* data, std::size_t count) {
+                out.write(reinterpret_cast<const char*>(data), count * sizeof(platter));
+            });
+        }
+        if (!out.flush()) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+    }
+};
+}  // namespace um
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+
+#include "memory_mapping.h"
+#include "opcode.h"
+
+namespace um {
+/** The statistics hooks for a machine which doesn't keep any. Every hook is
+    empty, so the engines compile exactly as if they weren't there.
+ */
+struct no_stats {
+    static constexpr bool enabled = false;
+
+    void op(std::uint8_t) {}
+
+    void prediction(opcode, bool) {}
+
+    void load_program(bool) {}
+
+    void allocate(std::size_t) {}
+
+    void abandon(std::size_t) {}
+
+    void memory(const mapping_stats&) {}
+
+    void dump() const {}
+};
+
+/** Counters for what a program does, selected at runtime with `--stats` or
+    `UM_STATS=1`.
+
+    This counts each opcode executed, the hits and misses of each `predict<>`
+    site, `load_program` copies and jumps, the peak number and size of the live
+    arrays, and how the array store mapped its memory. The summary is written to
+    stderr at `halt` or when the process gets `SIGUSR1`.
+ */
+class machine_stats {
+public:
+    static constexpr bool enabled = true;
+
+private:
+    static inline volatile std::sig_atomic_t dump_requested = 0;
+
+    std::array<std::uint64_t, 14> m_ops{};
+    // indexed by the opcode which made the prediction, then hit
+    std::array<std::array<std::uint64_t, 2>, 14> m_predictions{};
+    std::uint64_t m_load_program_copies = 0;
+    std::uint64_t m_load_program_jumps = 0;
+    std::uint64_t m_live_arrays = 0;
+    std::uint64_t m_peak_arrays = 0;
+    std::uint64_t m_live_bytes = 0;
+    std::uint64_t m_peak_bytes = 0;
+    mapping_stats m_memory;
+
+    static void request_dump(int) {
+        dump_requested = 1;
+    }
+
+public:
+    /** Install the `SIGUSR1` handler.
+     */
+    machine_stats() {
+        std::signal(SIGUSR1, request_dump);
+    }
+
+    void op(std::uint8_t op) {
+        ++m_ops[op];
+        if (__builtin_expect(dump_requested, 0)) {
+            dump_requested = 0;
+            dump();
+        }
+    }
+
+    void prediction(opcode site, bool hit) {
+        ++m_predictions[static_cast<std::uint8_t>(site)][hit];
+    }
+
+    void load_program(bool copy) {
+        ++(copy ? m_load_program_copies : m_load_program_jumps);
+    }
+
+    void allocate(std::size_t size) {
+        m_peak_arrays = std::max(m_peak_arrays, ++m_live_arrays);
+        m_live_bytes += size * sizeof(platter);
+        m_peak_bytes = std::max(m_peak_bytes, m_live_bytes);
+    }
+
+    void abandon(std::size_t size) {
+        --m_live_arrays;
+        m_live_bytes -= size * sizeof(platter);
+    }
+
+    /** Record what the array store has mapped so far.
+     */
+    void memory(const mapping_stats& memory) {
+        m_memory = memory;
+    }
+
+    void dump() const {
+        std::uint64_t total = 0;
+        for (std::uint64_t count : m_ops) {
+            total += count;
+        }
+        std::fprintf(stderr, "\n==== opcodes\n");
+        for (std::size_t op = 0; op < m_ops.size(); ++op) {
+            std::fprintf(stderr,
+                         "%20s %16llu %6.2f%%\n",
+                         opname[op].c_str(),
+                         static_cast<unsigned long long>(m_ops[op]),
+                         total ? 100.0 * m_ops[op] / total : 0.0);
+        }
+        std::fprintf(stderr,
+                     "%20s %16llu\n",
+                     "total",
+                     static_cast<unsigned long long>(total));
+
+        std::fprintf(stderr, "==== predictions\n");
+        for (std::size_t op = 0; op < m_predictions.size(); ++op) {
+            auto [misses, hits] = m_predictions[op];
+            if (hits + misses) {
+                std::fprintf(stderr,
+                             "%20s %16llu hit %16llu missed %6.2f%%\n",
+                             opname[op].c_str(),
+                             static_cast<unsigned long long>(hits),
+                             static_cast<unsigned long long>(misses),
+                             100.0 * hits / (hits + misses));
+            }
+        }
+
+        std::fprintf(stderr,
+                     "==== load_program\n%20s %16llu\n%20s %16llu\n",
+                     "copies",
+                     static_cast<unsigned long long>(m_load_program_copies),
+                     "jumps",
+                     static_cast<unsigned long long>(m_load_program_jumps));
+        std::fprintf(stderr,
+                     "==== arrays\n%20s %16llu\n%20s %16llu\n%20s %16llu\n",
+                     "live",
+                     static_cast<unsigned long long>(m_live_arrays),
+                     "peak live",
+                     static_cast<unsigned long long>(m_peak_arrays),
+                     "peak bytes",
+                     static_cast<unsigned long long>(m_peak_bytes));
+
+        if (m_memory.mapped_bytes) {
+            std::fprintf(stderr,
+                         "==== memory\n%20s %16llu\n%20s %16llu\n%20s %16llu\n"
+                         "%20s %16llu\n",
+                         "mapped bytes",
+                         static_cast<unsigned long long>(m_memory.mapped_bytes),
+                         "thp bytes",
+                         static_cast<unsigned long long>(m_memory.transparent_huge_bytes),
+                         "hugetlb bytes",
+                         static_cast<unsigned long long>(m_memory.explicit_huge_bytes),
+                         "hugetlb fallbacks",
+                         static_cast<unsigned long long>(m_memory.explicit_fallbacks));
+            if (m_memory.numa_node >= 0 || m_memory.numa_failures) {
+                std::fprintf(stderr,
+                             "%20s %16d\n%20s %16llu\n%20s %16llu\n",
+                             "numa node",
+                             m_memory.numa_node,
+                             "numa bound bytes",
+                             static_cast<unsigned long long>(m_memory.numa_bound_bytes),
+                             "numa failures",
+                             static_cast<unsigned long long>(m_memory.numa_failures));
+            }
+        }
+    }
+};
+}  // namespace um
@@ -0,0 +1,70 @@
+// Generated by etc/find-superinstructions; do not edit by hand.
+//
+//   etc/find-superinstructions uml-fib.trace
+//
+// 13459055 traced instructions. Counted independently, these patterns
+// save up to 32998688 dispatches.
+#pragma once
+
+#include <array>
+
+#include "opcode.h"
+
+namespace um {
+inline constexpr std::array<superinstruction, 16> superinstructions = {{
+    {4, {opcode::orthography, opcode::orthography, opcode::multiplication, opcode::orthography}},
+    {4, {opcode::orthography, opcode::multiplication, opcode::orthography, opcode::addition}},
+    {4, {opcode::multiplication, opcode::orthography, opcode::addition, opcode::addition}},
+    {4, {opcode::orthography, opcode::addition, opcode::addition, opcode::array_index}},
+    {4, {opcode::array_amendment, opcode::orthography, opcode::addition, opcode::orthography}},
+    {4, {opcode::array_index, opcode::orthography, opcode::orthography, opcode::multiplication}},
+    {4, {opcode::addition, opcode::addition, opcode::array_index, opcode::orthography}},
+    {4, {opcode::orthography, opcode::addition, opcode::orthography, opcode::array_index}},
+    {3, {opcode::orthography, opcode::orthography, opcode::multiplication}},
+    {3, {opcode::orthography, opcode::multiplication, opcode::orthography}},
+    {3, {opcode::multiplication, opcode::orthography, opcode::addition}},
+    {3, {opcode::orthography, opcode::addition, opcode::addition}},
+    {3, {opcode::orthography, opcode::addition, opcode::orthography}},
+    {3, {opcode::addition, opcode::addition, opcode::array_index}},
+    {3, {opcode::array_amendment, opcode::orthography, opcode::addition}},
+    {2, {opcode::orthography, opcode::addition}},
+}};
+}  // namespace um
+
+// The dispatch table entries and handlers to splice into
+// `machine::run_decoded()`.
+#define UM_SUPERINSTRUCTION_LABELS \
+    &&superinstruction_0,          \
+    &&superinstruction_1,          \
+    &&superinstruction_2,          \
+    &&superinstruction_3,          \
+    &&superinstruction_4,          \
+    &&superinstruction_5,          \
+    &&superinstruction_6,          \
+    &&superinstruction_7,          \
+    &&superinstruction_8,          \
+    &&superinstruction_9,          \
+    &&superinstruction_10,         \
+    &&superinstruction_11,         \
+    &&superinstruction_12,         \
+    &&superinstruction_13,         \
+    &&superinstruction_14,         \
+    &&superinstruction_15,
+
+#define UM_SUPERINSTRUCTION_HANDLERS       \
+    UM_SUPERINSTRUCTION(0, orthography)    \
+    UM_SUPERINSTRUCTION(1, addition)       \
+    UM_SUPERINSTRUCTION(2, addition)       \
+    UM_SUPERINSTRUCTION(3, array_index)    \
+    UM_SUPERINSTRUCTION(4, orthography)    \
+    UM_SUPERINSTRUCTION(5, multiplication) \
+    UM_SUPERINSTRUCTION(6, orthography)    \
+    UM_SUPERINSTRUCTION(7, array_index)    \
+    UM_SUPERINSTRUCTION(8, multiplication) \
+    UM_SUPERINSTRUCTION(9, orthography)    \
+    UM_SUPERINSTRUCTION(10, addition)      \
+    UM_SUPERINSTRUCTION(11, addition)      \
+    UM_SUPERINSTRUCTION(12, orthography)   \
+    UM_SUPERINSTRUCTION(13, array_index)   \
+    UM_SUPERINSTRUCTION(14, addition)      \
+    UM_SUPERINSTRUCTION(15, addition)
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined(UM_TRACE_OP_CODES)
+#include <zlib.h>
+
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+#endif
+
+namespace um {
+/** The version of the trace format written by a `make TRACE_OP_CODES=PATH`
+    build, and read by `etc/optrace.py`.
+
+    A trace starts with the magic `UMTRACE` and a byte of the version. The rest
+    is blocks, each a little-endian `std::uint32_t` count of opcodes, another of
+    the size of the payload, and the payload: the opcodes packed two to a byte,
+    the first in the low nibble, and compressed with zlib. Traces without the
+    magic are version 0, one opcode per byte.
+ */
+inline constexpr std::uint8_t trace_version = 1;
+
+#if defined(UM_TRACE_OP_CODES)
+#define STR2(x) #x
+#define STR(x) STR2(x)
+
+/** Writes every opcode executed to `UM_TRACE_OP_CODES`.
+
+    The machine packs opcodes into fixed size blocks in a ring. A full block is
+    handed to a writer thread, which compresses and writes it while the machine
+    fills the next; the machine only waits when the writer falls the whole ring
+    behind. If the writer fails, the machine rethrows its exception at the next
+    block it hands over or at `flush()`, and the destructor reports it.
+ */
+class op_code_tracer {
+private:
+    static constexpr std::size_t block_ops = 1 << 21;
+    static constexpr std::size_t ring_blocks = 8;
+
+    struct block {
+        std::array<std::uint8_t, block_ops / 2> packed;
+        std::size_t ops;
+    };
+
+    std::unique_ptr<block[]> m_ring;
+    // the number of blocks handed to the writer, and written by it
+    std::atomic<std::size_t> m_published{0};
+    std::atomic<std::size_t> m_written{0};
+    std::atomic<bool> m_done{false};
+    // set by the writer after it stores what it failed with in `m_error`
+    std::atomic<bool> m_failed{false};
+    std::exception_ptr m_error;
+    block* m_block;
+    std::size_t m_used = 0;
+    std::FILE* m_out;
+    std::thread m_writer;
+    std::size_t m_predictions = 0;
+    std::size_t m_mispredictions = 0;
+
+    static void put_u32(std::uint8_t* out, std::uint32_t value) {
+        for (int ix = 0; ix < 4; ++ix) {
+            out[ix] = value >> (8 * ix);
+        }
+    }
+
+    void write(const block& b) {
+        std::size_t packed_size = (b.ops + 1) / 2;
+        uLongf size = compressBound(packed_size);
+        std::vector<std::uint8_t> buffer(8 + size);
+        if (compress2(buffer.data() + 8, &size, b.packed.data(), packed_size, 1) !=
+            Z_OK) {
+            throw std::runtime_error("failed to compress the trace");
+        }
+        put_u32(buffer.data(), b.ops);
+        put_u32(buffer.data() + 4, size);
+        if (std::fwrite(buffer.data(), 1, 8 + size, m_out) != 8 + size) {
+            throw std::system_error(errno,
+                                    std::generic_category(),
+                                    STR(UM_TRACE_OP_CODES));
+        }
+    }
+
+    void write_blocks() {
+        std::size_t written = 0;
+        while (true) {
+            std::size_t published = m_published.load(std::memory_order_acquire);
+            if (written == published) {
+                if (m_done.load(std::memory_order_acquire) &&
+                    m_published.load(std::memory_order_acquire) == written) {
+                    return;
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                continue;
+            }
+            for (; written < published; ++written) {
+                write(m_ring[written % ring_blocks]);
+                m_written.store(written + 1, std::memory_order_release);
+            }
+        }
+    }
+
+    void run_writer() {
+        try {
+            write_blocks();
+        }
+        catch (...) {
+            // an exception escaping the thread would terminate the process
+            m_error = std::current_exception();
+            m_failed.store(true, std::memory_order_release);
+        }
+    }
+
+    /** Hand the current block to the writer and move on to the next, once the
+        writer is done with it.
+     */
+    void hand_off() {
+        m_block->ops = m_used;
+        m_used = 0;
+        std::size_t published = m_published.load(std::memory_order_relaxed) + 1;
+        m_published.store(published, std::memory_order_release);
+        while (published - m_written.load(std::memory_order_acquire) >= ring_blocks &&
+               !m_failed.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+        m_block = &m_ring[published % ring_blocks];
+    }
+
+    /** `hand_off()`, or rethrow what the writer failed with.
+     */
+    void publish() {
+        if (__builtin_expect(m_failed.load(std::memory_order_acquire), 0)) {
+            std::rethrow_exception(finish());
+        }
+        hand_off();
+    }
+
+    /** Write out the last block and wait for the writer.
+
+        @return What the writer failed with, if anything.
+     */
+    std::exception_ptr finish() {
+        if (!m_writer.joinable()) {
+            return nullptr;
+        }
+        if (m_used && !m_failed.load(std::memory_order_acquire)) {
+            hand_off();
+        }
+        m_done.store(true, std::memory_order_release);
+        m_writer.join();
+        if (std::fclose(m_out) && !m_error) {
+            m_error = std::make_exception_ptr(std::system_error(errno,
+                                                                std::generic_category(),
+                                                                STR(UM_TRACE_OP_CODES)));
+        }
+        return std::exchange(m_error, nullptr);
+    }
+
+public:
+    op_code_tracer()
+        : m_ring(new block[ring_blocks]),
+          m_block(&m_ring[0]),
+          m_out(std::fopen(STR(UM_TRACE_OP_CODES), "wb")) {
+        if (!m_out) {
+            throw std::system_error(errno,
+                                    std::generic_category(),
+                                    STR(UM_TRACE_OP_CODES));
+        }
+        std::fwrite("UMTRACE", 1, 7, m_out);
+        std::fputc(trace_version, m_out);
+        m_writer = std::thread([this] { run_writer(); });
+    }
+
+    op_code_tracer(const op_code_tracer&) = delete;
+    op_code_tracer& operator=(const op_code_tracer&) = delete;
+
+    ~op_code_tracer() {
+        if (std::exception_ptr error = finish()) {
+            try {
+                std::rethrow_exception(error);
+            }
+            catch (const std::exception& e) {
+                std::cerr << "failed to write the trace: " << e.what() << '\n';
+            }
+        }
+    }
+
+    void operator()(std::uint8_t op) {
+        // the decoded engine's superinstructions don't fit; trace with another
+        std::uint8_t& packed = m_block->packed[m_used >> 1];
+        if (m_used & 1) {
+            packed |= (op & 0xf) << 4;
+        }
+        else {
+            packed = op & 0xf;
+        }
+        if (++m_used == block_ops) {
+            publish();
+        }
+    }
+
+    void prediction(bool b) {
+        if (b) {
+            m_predictions += 1;
+        }
+        else {
+            m_mispredictions += 1;
+        }
+    }
+
+    void flush() {
+        std::cerr << "\n\n====   predicted: " << m_predictions
+                  << "\n====mispredicted: " << m_mispredictions << "\n====           %: "
+                  << static_cast<double>(m_predictions) /
+                         (m_predictions + m_mispredictions)
+                  << '\n';
+        if (std::exception_ptr error = finish()) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+#undef STR
+#undef STR2
+#else
+struct op_code_tracer {
+    void operator()(std::uint8_t) {}
+
+    void prediction(bool) {}
+
+    void flush() {}
+};
+#endif
+}  // namespace um
@@ -0,0 +1,68 @@
+#include "vm.h"
+
+#include "jit.h"
+#include "machine.h"
+#include "program_image.h"
+
+namespace um {
+struct vm::impl {
+    machine m;
+    engine run_engine;
+
+    template<typename Source>
+    impl(Source&& source, options&& opts)
+        : m(std::move(source),
+            machine_io(opts.mode, std::move(opts.input), std::move(opts.output))),
+          run_engine(opts.run_engine) {}
+};
+
+vm::vm(const char* path) : vm(path, options()) {}
+
+vm::vm(const char* path, options opts)
+    : m_impl(std::make_unique<impl>(program_image(path), std::move(opts))) {}
+
+vm::vm(std::vector<platter> program) : vm(std::move(program), options()) {}
+
+vm::vm(std::vector<platter> program, options opts)
+    : m_impl(std::make_unique<impl>(std::move(program), std::move(opts))) {}
+
+vm::vm(vm&&) noexcept = default;
+vm& vm::operator=(vm&&) noexcept = default;
+vm::~vm() = default;
+
+machine_status vm::run_for(std::size_t count) {
+    return m_impl->m.run_for(count);
+}
+
+machine_status vm::run_until_halt() {
+    machine& m = m_impl->m;
+    switch (m_impl->run_engine) {
+    case engine::reference:
+        m.run();
+        break;
+    case engine::threaded:
+        m.run_threaded();
+        break;
+    case engine::decoded:
+        m.run_decoded();
+        break;
+    case engine::jit:
+        if constexpr (jit::enabled) {
+            m.run_jit();
+        }
+        else {
+            m.run_decoded();
+        }
+        break;
+    }
+    return m.status();
+}
+
+machine_status vm::status() const {
+    return m_impl->m.status();
+}
+
+void vm::flush() {
+    m_impl->m.flush();
+}
+}  // namespace um
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "io.h"
+#include "machine_status.h"
+#include "opcode.h"
+
+namespace um {
+/** A machine to embed in another program; the interface of `libum.a`.
+
+    Nothing here exits the process or touches stdio behind the caller's back: the
+    machine runs until it halts, runs out of its budget, or needs input its reader
+    doesn't have yet, and then returns to the caller. Many of them may be
+    time-sliced on one thread.
+ */
+class vm {
+public:
+    enum class engine {
+        /** `--engine=switch`
+         */
+        reference,
+        threaded,
+        decoded,
+        /** The decoded engine where there is no JIT.
+         */
+        jit,
+    };
+
+    struct options {
+        engine run_engine = engine::decoded;
+        io_mode mode = io_mode::batch;
+
+        /** Where `input` reads from; stdin by default. Return
+            `machine_io::would_block` to make the machine stop and wait.
+         */
+        machine_io::reader input = machine_io::read_fd(0);
+
+        /** Where `output` writes to; stdout by default.
+         */
+        machine_io::writer output = machine_io::write_fd(1);
+    };
+
+private:
+    struct impl;
+    std::unique_ptr<impl> m_impl;
+
+public:
+    /** Load the UM image at `path`.
+     */
+    explicit vm(const char* path);
+    vm(const char* path, options opts);
+
+    /** Run `program`, already in native byte order.
+     */
+    explicit vm(std::vector<platter> program);
+    vm(std::vector<platter> program, options opts);
+
+    vm(vm&&) noexcept;
+    vm& operator=(vm&&) noexcept;
+    ~vm();
+
+    /** Run about `count` instructions with the reference engine.
+
+        @return `machine_status::running` if the budget ran out first.
+     */
+    machine_status run_for(std::size_t count);
+
+    /** Run with the chosen engine until the machine halts or waits for input.
+     */
+    machine_status run_until_halt();
+
+    machine_status status() const;
+
+    /** Write out any buffered output.
+     */
+    void flush();
+};
+}  // namespace um
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace um {
+/** Run `f(index)` for every `index` in `[0, count)` on `threads` threads.
+
+    Each thread starts with its own contiguous share of the indices and takes them
+    from the back of its queue; a thread which runs out steals from the front of
+    the others' queues, so a few long jobs don't leave the rest of the threads
+    idle. `f` must be safe to call concurrently.
+ */
+template<typename F>
+void work_stealing_for(std::size_t count, std::size_t threads, F&& f) {
+    struct worker_queue {
+        std::mutex lock;
+        std::deque<std::size_t> indices;
+
+        std::optional<std::size_t> pop() {
+            std::lock_guard<std::mutex> guard(lock);
+            if (indices.empty()) {
+                return std::nullopt;
+            }
+            std::size_t index = indices.back();
+            indices.pop_back();
+            return index;
+        }
+
+        std::optional<std::size_t> steal() {
+            std::lock_guard<std::mutex> guard(lock);
+            if (indices.empty()) {
+                return std::nullopt;
+            }
+            std::size_t index = indices.front();
+            indices.pop_front();
+            return index;
+        }
+    };
+
+    threads = std::max<std::size_t>(1, std::min(threads, count));
+    std::vector<std::unique_ptr<worker_queue>> queues;
+    for (std::size_t worker = 0; worker < threads; ++worker) {
+        auto& queue = queues.emplace_back(std::make_unique<worker_queue>());
+        std::size_t begin = count * worker / threads;
+        std::size_t end = count * (worker + 1) / threads;
+        // pop() takes from the back, so the lowest index runs first
+        for (std::size_t index = end; index-- > begin;) {
+            queue->indices.push_back(index);
+        }
+    }
+
+    auto work = [&](std::size_t worker) {
+        while (true) {
+            std::optional<std::size_t> index = queues[worker]->pop();
+            for (std::size_t offset = 1; !index && offset < threads; ++offset) {
+                index = queues[(worker + offset) % threads]->steal();
+            }
+            if (!index) {
+                // nothing is ever added to a queue, so they are all empty for good
+                return;
+            }
+            f(*index);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (std::size_t worker = 1; worker < threads; ++worker) {
+        pool.emplace_back(work, worker);
+    }
+    work(0);
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+}
+}  // namespace um